@@ -2,12 +2,42 @@
 
 set TARGET=chip8
 set CC=clang
-set CFLAGS=-Wall -Wextra -Iinclude
+set AR=llvm-ar
+set CFLAGS=-Wall -Wextra -Iinclude -Isrc
 set LDFLAGS=-Llibs -lraylibdll -lkernel32 -lopengl32 -luser32
 
+rem set THREADED=1 before running to select the computed-goto dispatcher
+if "%THREADED%"=="1" set CFLAGS=%CFLAGS% -DCHIP8_THREADED_DISPATCH
+
+rem set PROFILE=1 to count opcodes and hot addresses, see src\chip8_profile.c
+if "%PROFILE%"=="1" set CFLAGS=%CFLAGS% -DCHIP8_PROFILE
+
+rem set AOT=rom_aot.c to link in a translation made by chip8-aot
+set CORE_SOURCES=.\src\chip8.c .\src\chip8_jit.c .\src\chip8_soa.c .\src\chip8_state.c .\src\chip8_rewind.c .\src\chip8_replay.c .\src\chip8_profile.c .\src\chip8_trace.c
+if not "%AOT%"=="" (
+    set CFLAGS=%CFLAGS% -DCHIP8_AOT
+    set CORE_SOURCES=%CORE_SOURCES% %AOT%
+)
+
 if not exist .\build (
     mkdir .\build
     copy .\libs\raylib.dll .\build
 )
 
-%CC% %CFLAGS% -o .\build\%TARGET%.exe .\src\chip8.c %LDFLAGS%
+rem libchip8.a is the headless core, it does not need raylib
+setlocal enabledelayedexpansion
+set CORE_OBJECTS=
+for %%f in (%CORE_SOURCES%) do (
+    %CC% %CFLAGS% -c -o .\build\%%~nf.o %%f
+    set CORE_OBJECTS=!CORE_OBJECTS! .\build\%%~nf.o
+)
+if exist .\build\libchip8.a del .\build\libchip8.a
+%AR% rcs .\build\libchip8.a %CORE_OBJECTS%
+
+%CC% %CFLAGS% -o .\build\%TARGET%.exe .\src\main.c .\build\libchip8.a %LDFLAGS%
+%CC% %CFLAGS% -o .\build\chip8-aot.exe .\tools\chip8_aot.c
+%CC% %CFLAGS% -o .\build\chip8-batch.exe .\tools\chip8_batch.c .\build\libchip8.a
+%CC% %CFLAGS% -o .\build\chip8-trace.exe .\tools\chip8_trace.c .\build\libchip8.a
+%CC% %CFLAGS% -o .\build\chip8-bench.exe .\tools\chip8_bench.c .\build\libchip8.a
+%CC% %CFLAGS% -o .\build\chip8-conform.exe .\tools\chip8_conform.c .\build\libchip8.a
+%CC% %CFLAGS% -o .\build\chip8-fuzz.exe .\tools\chip8_fuzz.c .\build\libchip8.a
@@ -1,13 +1,52 @@
 #/usr/bin/sh
 set -xe
 
-CC=clang
-CFLAGS=-Wall -Wextra -Iinclude
-LDFLAGS=-L libs -lraylib
+CC="${CC:-clang}"
+AR="${AR:-ar}"
+CFLAGS="-Wall -Wextra -Iinclude -Isrc $CFLAGS"
+LDFLAGS="-L libs -lraylib -lpthread"
 
-if [ ! -f ./build]; then
+# THREADED=1 ./build.sh selects the computed-goto dispatcher (GCC/Clang only)
+if [ "$THREADED" = "1" ]; then
+    CFLAGS="$CFLAGS -DCHIP8_THREADED_DISPATCH"
+fi
+
+# JIT=1 ./build.sh adds the x86-64 recompiler (Linux/BSD only)
+if [ "$JIT" = "1" ]; then
+    CFLAGS="$CFLAGS -DCHIP8_JIT"
+fi
+
+# PROFILE=1 ./build.sh counts opcodes and hot addresses, see src/chip8_profile.c
+if [ "$PROFILE" = "1" ]; then
+    CFLAGS="$CFLAGS -DCHIP8_PROFILE"
+fi
+
+# AOT=rom_aot.c ./build.sh links in a translation made by chip8-aot
+CORE_SOURCES="./src/chip8.c ./src/chip8_jit.c ./src/chip8_soa.c ./src/chip8_state.c ./src/chip8_rewind.c ./src/chip8_replay.c ./src/chip8_profile.c ./src/chip8_trace.c"
+if [ -n "$AOT" ]; then
+    CFLAGS="$CFLAGS -DCHIP8_AOT"
+    CORE_SOURCES="$CORE_SOURCES $AOT"
+fi
+
+if [ ! -d ./build ]; then
     mkdir ./build
     cp ./libs/libraylib.so ./build
 fi
 
-$CC $CFLAGS -o chip8 ./src/chip8.c $LDFLAGS
+# libchip8.a is the headless core, it does not need raylib
+CORE_OBJECTS=""
+for src in $CORE_SOURCES; do
+    obj="./build/$(basename "$src" .c).o"
+    $CC $CFLAGS -c -o "$obj" "$src"
+    CORE_OBJECTS="$CORE_OBJECTS $obj"
+done
+rm -f ./build/libchip8.a
+$AR rcs ./build/libchip8.a $CORE_OBJECTS
+
+$CC $CFLAGS -o chip8 ./src/main.c ./build/libchip8.a $LDFLAGS
+$CC $CFLAGS -o chip8-aot ./tools/chip8_aot.c
+$CC $CFLAGS -o chip8-batch ./tools/chip8_batch.c ./build/libchip8.a -lpthread
+$CC $CFLAGS -o chip8-trace ./tools/chip8_trace.c ./build/libchip8.a -lpthread
+$CC $CFLAGS -o chip8-bench ./tools/chip8_bench.c ./build/libchip8.a -lpthread
+$CC $CFLAGS -o chip8-conform ./tools/chip8_conform.c ./build/libchip8.a -lpthread
+$CC $CFLAGS -o chip8-fuzz ./tools/chip8_fuzz.c ./build/libchip8.a -lpthread
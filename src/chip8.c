@@ -1,62 +1,86 @@
-#include <raylib.h>
-#include <stdint.h>
+#include "chip8.h"
+
 #include <assert.h>
-#include <stdbool.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
-#define CHIP8_DEFAULT_WINDOW_WIDTH 64
-#define CHIP8_DEFAULT_WINDOW_HEIGHT 32
-#define CHIP8_DEFAULT_SCALE_FACTOR 10
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-typedef struct {
-    uint32_t window_width, window_height;
-    Color fg_color, bg_color;
-    uint32_t scale_factor;
-    const char* rom_name;
-    bool with_pixel_outlines;
-} Config;
+#ifdef CHIP8_THREADED_DISPATCH
+#include <threads.h>
+#endif
 
-void set_config_from_args(Config* cfg, int argc, const char** argv)
+// Fallback for the log callback when a host leaves it NULL
+static void chip8_default_log(void* user, Chip8_Log_Level level, const char* message)
 {
-    cfg->rom_name = argv[1];
-    cfg->scale_factor = CHIP8_DEFAULT_SCALE_FACTOR;
-    cfg->with_pixel_outlines = true;
-    cfg->fg_color = RED;
-    cfg->bg_color = BLACK;
-    for(int i = 0; i < argc; ++i) {
-        (void)argv[i];
-    }
+    (void)user;
+    static const char* const names[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+    fprintf(stderr, "%s: %s", names[level], message);
 }
 
-typedef enum {
-    EMULATOR_QUIT = 0,
-    EMULATOR_RUNNING,
-    EMULATOR_PAUSED,
-} Emulator_State;
-
-#define CHIP8_RAM_CAPACITY 0x1000
-#define CHIP8_STACK_B 0xEA0
-#define CHIP8_STACK_E 0xEFF
-#define CHIP8_STACK_SIZE (CHIP8_STACK_E - CHIP8_STACK_B)
-#define CHIP8_ROM_B 0x200
-
-typedef struct {
-    Emulator_State state;
-    uint8_t ram[CHIP8_RAM_CAPACITY];
-    bool display[CHIP8_DEFAULT_WINDOW_WIDTH*CHIP8_DEFAULT_WINDOW_HEIGHT];
-    uint16_t* stack;
-    uint8_t V[16]; // registers
-    uint16_t I; // index registers
-    uint16_t PC; // Program Counter
-    uint8_t delay_timer; // Decrements at 60hz when > 0
-    uint8_t sound_timer; // Decrements at 60hz and plays tone when > 0
-    bool keypad[16]; // 0x0 0xF
-    const char* rom_name;
-} Chip8;
-
-bool chip8_init(Chip8* c, Config conf)
-{
-    memset(c->ram, 0, CHIP8_RAM_CAPACITY);
+void chip8_log(const Chip8* c, Chip8_Log_Level level, const char* fmt, ...)
+{
+    char message[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    c->host.log(c->host.user, level, message);
+}
+
+// Shared by every instance and thread, relaxed is enough for counters
+static _Atomic uint64_t chip8_allocation_count, chip8_allocated_bytes;
+
+static void chip8_count_allocation(size_t size)
+{
+    atomic_fetch_add_explicit(&chip8_allocation_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&chip8_allocated_bytes, size, memory_order_relaxed);
+}
+
+void* chip8_malloc(size_t size)
+{
+    chip8_count_allocation(size);
+    return malloc(size);
+}
+
+void* chip8_calloc(size_t count, size_t size)
+{
+    chip8_count_allocation(count * size);
+    return calloc(count, size);
+}
+
+void* chip8_realloc(void* p, size_t size)
+{
+    chip8_count_allocation(size);
+    return realloc(p, size);
+}
+
+void chip8_free(void* p)
+{
+    free(p);
+}
+
+void chip8_allocations(uint64_t* count, uint64_t* bytes)
+{
+    *count = atomic_load_explicit(&chip8_allocation_count, memory_order_relaxed);
+    *bytes = atomic_load_explicit(&chip8_allocated_bytes, memory_order_relaxed);
+}
+
+bool chip8_init(Chip8* c, const Chip8_Host* host)
+{
+    // Registers, timers and the display all start cleared, a re-initialized
+    // instance must not inherit anything from its previous run
+    memset(c, 0, sizeof(*c));
+
+    if(host != NULL) c->host = *host;
+    if(c->host.log == NULL) c->host.log = chip8_default_log;
 
     // Load FONT
     const uint8_t fonts[] = {
@@ -79,65 +103,87 @@ bool chip8_init(Chip8* c, Config conf)
     };
     memcpy(&c->ram[0], fonts, sizeof(fonts));
 
-    // Load ROM
-    uint32_t rom_size = 0;
-    uint8_t* data = LoadFileData(conf.rom_name, &rom_size);
-    if(data == NULL) {
-        TraceLog(LOG_FATAL, "ROM file %s is invalid or not exist\n", conf.rom_name);
+    c->state = EMULATOR_RUNNING;
+    c->dirty_rows = ~0ull;
+    c->PC = CHIP8_ROM_B;
+    c->stack = (uint16_t*)&c->ram[CHIP8_STACK_B];
+    chip8_seed(c, CHIP8_DEFAULT_SEED);
+#ifdef CHIP8_THREADED_DISPATCH
+    chip8_threaded_init();
+#endif
+#ifdef CHIP8_PROFILE
+    c->profile = chip8_profile_create();
+    if(c->profile == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Out of memory for the profile\n");
         return false;
     }
+#endif
+    return true;
+}
 
-    if(rom_size > CHIP8_RAM_CAPACITY - CHIP8_ROM_B) {
-        TraceLog(LOG_FATAL, "ROM file %s is too big %ld > %d\n", conf.rom_name, rom_size, CHIP8_RAM_CAPACITY);
-        UnloadFileData(data);
+bool chip8_load_rom(Chip8* c, const uint8_t* rom, size_t size)
+{
+    if(size > CHIP8_RAM_CAPACITY - CHIP8_ROM_B) {
+        chip8_log(c, CHIP8_LOG_ERROR, "ROM is too big %zu > %d\n", size, CHIP8_RAM_CAPACITY - CHIP8_ROM_B);
         return false;
     }
+    memcpy(&c->ram[CHIP8_ROM_B], rom, size);
+    return true;
+}
 
-    for(uint32_t i = 0; i < rom_size; ++i)
-        c->ram[CHIP8_ROM_B + i] = data[i];
-    UnloadFileData(data);
+bool chip8_load_rom_file(Chip8* c, const char* path)
+{
+    uint8_t rom[CHIP8_RAM_CAPACITY];
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "ROM file %s is invalid or not exist\n", path);
+        return false;
+    }
 
-    c->state = EMULATOR_RUNNING;
-    c->PC = CHIP8_ROM_B;
-    c->stack = (uint16_t*)&c->ram[CHIP8_STACK_B];
-    return true;
+    // Read one byte more than fits so oversized ROMs are reported
+    size_t size = fread(rom, 1, CHIP8_RAM_CAPACITY - CHIP8_ROM_B + 1, f);
+    bool failed = ferror(f) != 0;
+    fclose(f);
+    if(failed) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Failed to read ROM file %s\n", path);
+        return false;
+    }
+    return chip8_load_rom(c, rom, size);
 }
 
-void chip8_deinit(Chip8 c)
+void chip8_seed(Chip8* c, uint32_t seed)
 {
-    (void)c;
+    c->rng = seed != 0 ? seed : CHIP8_DEFAULT_SEED;
 }
 
-void handle_input(Chip8* c)
+uint8_t chip8_random(Chip8* c)
 {
-    if(WindowShouldClose()) {
-        c->state = EMULATOR_QUIT;
-    } else if(IsKeyPressed(KEY_SPACE)) {
-        if(c->state == EMULATOR_PAUSED) {
-            c->state = EMULATOR_RUNNING;
-            TraceLog(LOG_INFO, "===== Running =====\n");
-        } else {
-            c->state = EMULATOR_PAUSED;
-            TraceLog(LOG_INFO, "===== Paused =====\n");
-        }
-    } else {
-    }
+    // xorshift32
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+    return (uint8_t)c->rng;
 }
 
-typedef struct {
-    uint16_t opcode;
-    uint8_t X; // the 2nd nibble of the opcode
-    uint8_t Y; // the 3rd nibble of the opcode
-    uint8_t N; // the 4th nibble of the opcode
-    uint8_t NN; // Y and N combined or the second byte (8 bit)
-    uint16_t NNN; // X, Y and N combined (12bit)
-} Inst;
+void chip8_deinit(Chip8* c)
+{
+#ifndef NDEBUG
+    chip8_trace_stop(c);
+#endif
+#ifdef CHIP8_JIT
+    chip8_jit_deinit(c);
+#endif
+#ifdef CHIP8_PROFILE
+    chip8_profile_destroy(c->profile);
+    c->profile = NULL;
+#endif
+    c->state = EMULATOR_QUIT;
+}
 
-Inst chip8_fetch_next_instruction(Chip8* c)
+Inst chip8_decode(uint16_t opcode)
 {
     Inst inst = {0};
-    inst.opcode = (c->ram[c->PC] << 8) | c->ram[c->PC+1];
-    c->PC += 2;
+    inst.opcode = opcode;
     inst.NNN = inst.opcode & 0x0FFF;
     inst.NN = inst.opcode & 0x0FF;
     inst.N = inst.opcode & 0x0F;
@@ -146,289 +192,871 @@ Inst chip8_fetch_next_instruction(Chip8* c)
     return inst;
 }
 
-void update_screen(const Chip8* c, Config cfg)
+Inst chip8_fetch_next_instruction(Chip8* c)
 {
-    Rectangle r = (Rectangle){ .x = 0, .y = 0, .width = cfg.scale_factor, .height = cfg.scale_factor };
+    // Only the low 12 bits address anything, PC runs past 0xFFF after a skip
+    // or BNNN near the top and 00EE returns whatever is on the stack
+    Inst inst = chip8_decode((c->ram[c->PC & CHIP8_ADDRESS_MASK] << 8)
+            | c->ram[(c->PC + 1) & CHIP8_ADDRESS_MASK]);
+    c->PC += 2;
+    return inst;
+}
 
-    for(uint32_t i = 0; i < sizeof(c->display); i++) {
-        r.x = (i % CHIP8_DEFAULT_WINDOW_WIDTH) * cfg.scale_factor;
-        r.y = (i / CHIP8_DEFAULT_WINDOW_WIDTH) * cfg.scale_factor;
+// Every store into RAM must go through here (or call chip8_invalidate) so the
+// predecode cache never hands out a stale instruction.
+void chip8_invalidate(Chip8* c, uint16_t addr)
+{
+    addr %= CHIP8_RAM_CAPACITY;
+    c->written[addr / 64] |= 1ull << (addr % 64);
+    c->decoded[addr >> 1].handler = NULL;
+    if(addr >= 2) {
+        // The instruction may be the second half of a superinstruction
+        Chip8_Decoded* previous = &c->decoded[(addr >> 1) - 1];
+        if(previous->run != previous->handler && previous->run != NULL) previous->handler = NULL;
+    }
+#ifdef CHIP8_JIT
+    if(c->jit != NULL)
+        chip8_jit_invalidate(c, addr);
+#endif
+}
 
-        if(c->display[i]) {
-            DrawRectangleRec(r, cfg.fg_color);
+bool chip8_ram_written(const Chip8* c, uint16_t begin, uint16_t end)
+{
+    if(begin >= end)
+        return false;
+    uint16_t last = end - 1;
+    for(uint16_t word = begin / 64; word <= last / 64; ++word) {
+        uint64_t mask = ~0ull;
+        if(word == begin / 64)
+            mask &= ~0ull << (begin % 64);
+        if(word == last / 64)
+            mask &= ~0ull >> (63 - last % 64);
+        if(c->written[word] & mask)
+            return true;
+    }
+    return false;
+}
 
-            if(cfg.with_pixel_outlines) {
-                DrawRectangleLinesEx(r, 1.0f, cfg.bg_color);
-            }
+void chip8_write_ram(Chip8* c, uint16_t addr, uint8_t value)
+{
+    addr %= CHIP8_RAM_CAPACITY;
+    c->ram[addr] = value;
+    chip8_invalidate(c, addr);
+}
+
+// Opcode handlers. Each one expects c->PC to already point past the
+// instruction, exactly like the old inline switch did.
+
+void chip8_op_nop(Chip8* c, Inst inst)
+{
+    (void)c;
+    (void)inst;
+}
+
+void chip8_op_00E0(Chip8* c, Inst inst)
+{
+    (void)inst;
+    memset(c->display, 0, sizeof(c->display));
+    c->dirty_rows = ~0ull;
+}
+
+void chip8_op_00EE(Chip8* c, Inst inst)
+{
+    (void)inst;
+    // 2NNN leaves the stack pointer one past the return address it pushed
+    uint16_t* bottom = (uint16_t*)&c->ram[CHIP8_STACK_B];
+    if(c->stack == bottom) c->stack = bottom + CHIP8_STACK_DEPTH;
+    c->stack -= 1;
+    c->PC = *c->stack;
+}
+
+void chip8_op_00FE(Chip8* c, Inst inst)
+{
+    // 0x00FE SCHIP: switch to the 64x32 display
+    (void)inst;
+    c->hires = false;
+    memset(c->display, 0, sizeof(c->display));
+    c->dirty_rows = ~0ull;
+}
+
+void chip8_op_00FF(Chip8* c, Inst inst)
+{
+    // 0x00FF SCHIP: switch to the 128x64 display
+    (void)inst;
+    c->hires = true;
+    memset(c->display, 0, sizeof(c->display));
+    c->dirty_rows = ~0ull;
+}
+
+void chip8_op_1NNN(Chip8* c, Inst inst)
+{
+    c->PC = inst.NNN;
+}
+
+void chip8_op_2NNN(Chip8* c, Inst inst)
+{
+    // 0x2NNN Call subroutine at NNN
+    uint16_t* stack_ptr = c->stack;
+    *stack_ptr = c->PC; // save current address to to return to on subroutine stack
+    uint16_t stack_addr = (uint16_t)((uint8_t*)stack_ptr - c->ram);
+    chip8_invalidate(c, stack_addr);
+    chip8_invalidate(c, stack_addr + 1);
+    c->PC = inst.NNN; // set program counter to NNN
+    c->stack += 1;
+    if(c->stack == (uint16_t*)&c->ram[CHIP8_STACK_B] + CHIP8_STACK_DEPTH) {
+        c->stack = (uint16_t*)&c->ram[CHIP8_STACK_B];
+    }
+}
+
+void chip8_op_3XNN(Chip8* c, Inst inst)
+{
+    if(c->V[inst.X] == inst.NN) {
+        c->PC += 2;
+    }
+}
+
+void chip8_op_4XNN(Chip8* c, Inst inst)
+{
+    if(c->V[inst.X] != inst.NN) {
+        c->PC += 2;
+    }
+}
+
+void chip8_op_5XY0(Chip8* c, Inst inst)
+{
+    if(c->V[inst.X] == c->V[inst.Y]) {
+        c->PC += 2;
+    }
+}
+
+void chip8_op_6XNN(Chip8* c, Inst inst)
+{
+    c->V[inst.X] = inst.NN;
+}
+
+void chip8_op_7XNN(Chip8* c, Inst inst)
+{
+    c->V[inst.X] += inst.NN;
+}
+
+void chip8_op_8XY0(Chip8* c, Inst inst)
+{
+    c->V[inst.X] = c->V[inst.Y];
+}
+
+void chip8_op_8XY1(Chip8* c, Inst inst)
+{
+    c->V[inst.X] |= c->V[inst.Y];
+}
+
+void chip8_op_8XY2(Chip8* c, Inst inst)
+{
+    c->V[inst.X] &= c->V[inst.Y];
+}
+
+void chip8_op_8XY3(Chip8* c, Inst inst)
+{
+    c->V[inst.X] ^= c->V[inst.Y];
+}
+
+// The arithmetic ops write VF last, when X is F the flag is what remains.
+// 8XY5 and 8XY7 set it when there is no borrow.
+void chip8_op_8XY4(Chip8* c, Inst inst)
+{
+    const uint16_t sum = c->V[inst.X] + c->V[inst.Y];
+    c->V[inst.X] = (uint8_t)sum;
+    c->V[0xF] = sum > 0xFF;
+}
+
+void chip8_op_8XY5(Chip8* c, Inst inst)
+{
+    const uint8_t flag = c->V[inst.X] >= c->V[inst.Y];
+    c->V[inst.X] -= c->V[inst.Y];
+    c->V[0xF] = flag;
+}
+
+void chip8_op_8XY6(Chip8* c, Inst inst)
+{
+    const uint8_t flag = c->V[inst.X] & 0x01;
+    c->V[inst.X] >>= 1;
+    c->V[0xF] = flag;
+}
+
+void chip8_op_8XY7(Chip8* c, Inst inst)
+{
+    const uint8_t flag = c->V[inst.Y] >= c->V[inst.X];
+    c->V[inst.X] = c->V[inst.Y] - c->V[inst.X];
+    c->V[0xF] = flag;
+}
+
+void chip8_op_8XYE(Chip8* c, Inst inst)
+{
+    const uint8_t flag = c->V[inst.X] >> 7;
+    c->V[inst.X] <<= 1;
+    c->V[0xF] = flag;
+}
+
+void chip8_op_9XY0(Chip8* c, Inst inst)
+{
+    if(c->V[inst.X] != c->V[inst.Y]) {
+        c->PC += 2;
+    }
+}
+
+void chip8_op_ANNN(Chip8* c, Inst inst)
+{
+    c->I = inst.NNN;
+}
+
+void chip8_op_BNNN(Chip8* c, Inst inst)
+{
+    c->PC = c->V[0] + inst.NNN;
+}
+
+void chip8_op_CXNN(Chip8* c, Inst inst)
+{
+    const uint8_t r = c->host.random != NULL ? c->host.random(c->host.user) : chip8_random(c);
+    c->V[inst.X] = r & inst.NN;
+}
+
+static inline uint64_t shift_right(uint64_t v, uint32_t n) { return n >= 64 ? 0 : v >> n; }
+static inline uint64_t shift_left(uint64_t v, uint32_t n) { return n >= 64 ? 0 : v << n; }
+
+// XORs n left aligned sprite rows into consecutive rows of one display word,
+// each row shifted right then left by the given counts (64 or more clears
+// it). Returns non zero if any lit pixel was turned off.
+static uint64_t chip8_blit_word(uint64_t* dst, const uint64_t* rows, uint32_t n,
+        uint32_t right, uint32_t left)
+{
+    uint64_t collision = 0;
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    const __m128i r4 = _mm_cvtsi32_si128((int)right);
+    const __m128i l4 = _mm_cvtsi32_si128((int)left);
+    __m256i hit4 = _mm256_setzero_si256();
+    for(; i + 4 <= n; i += 4) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)&rows[i]);
+        __m256i d = _mm256_loadu_si256((const __m256i*)&dst[i]);
+        s = _mm256_sll_epi64(_mm256_srl_epi64(s, r4), l4);
+        hit4 = _mm256_or_si256(hit4, _mm256_and_si256(d, s));
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(d, s));
+    }
+    collision |= !_mm256_testz_si256(hit4, hit4);
+#endif
+
+#if defined(__SSE2__)
+    const __m128i r2 = _mm_cvtsi32_si128((int)right);
+    const __m128i l2 = _mm_cvtsi32_si128((int)left);
+    __m128i hit2 = _mm_setzero_si128();
+    for(; i + 2 <= n; i += 2) {
+        __m128i s = _mm_loadu_si128((const __m128i*)&rows[i]);
+        __m128i d = _mm_loadu_si128((const __m128i*)&dst[i]);
+        s = _mm_sll_epi64(_mm_srl_epi64(s, r2), l2);
+        hit2 = _mm_or_si128(hit2, _mm_and_si128(d, s));
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(d, s));
+    }
+    collision |= _mm_movemask_epi8(_mm_cmpeq_epi8(hit2, _mm_setzero_si128())) != 0xFFFF;
+#endif
+
+    for(; i < n; i++) {
+        const uint64_t s = shift_left(shift_right(rows[i], right), left);
+        collision |= dst[i] & s;
+        dst[i] ^= s;
+    }
+    return collision;
+}
+
+void chip8_op_DXYN(Chip8* c, Inst inst)
+{
+    // 0xDXYN Draw N height sprite at coords X,Y; Read from memory
+    // Screen pixels is XOR'd with sprite bits
+    // location I. VF (Carry flag) is set if any screen pixels
+    // are set off
+    // In hires mode DXY0 draws a 16x16 sprite, two bytes per row
+    // The display is stored column of words first so the rows a sprite
+    // touches in one word are contiguous and can be blitted a vector at a
+    // time. Bits pushed past the right edge are dropped which clips the sprite
+    const uint32_t width = CHIP8_WIDTH(c);
+    const uint32_t height = CHIP8_HEIGHT(c);
+    const uint32_t x_coord = c->V[inst.X] % width;
+    const uint32_t y_coord = c->V[inst.Y] % height;
+    const bool wide = c->hires && inst.N == 0;
+    uint32_t n = wide ? 16 : inst.N;
+    uint64_t rows[16];
+    uint64_t collision = 0;
+
+    // stop drawing if it hit the bottom of the screen;
+    if(n > height - y_coord) n = height - y_coord;
+
+    for(uint32_t i = 0; i < n; i++) {
+        if(wide) {
+            const uint64_t hi = c->ram[(c->I + 2*i) % CHIP8_RAM_CAPACITY];
+            const uint64_t lo = c->ram[(c->I + 2*i + 1) % CHIP8_RAM_CAPACITY];
+            rows[i] = (hi << 56) | (lo << 48);
         } else {
-            DrawRectangleRec(r, cfg.bg_color);
+            rows[i] = (uint64_t)c->ram[(c->I + i) % CHIP8_RAM_CAPACITY] << 56;
         }
     }
 
-    SwapScreenBuffer();
+    if(n > 0) c->dirty_rows |= (~0ull >> (64 - n)) << y_coord;
+
+    collision |= chip8_blit_word(&c->display[0][y_coord], rows, n, x_coord, 0);
+    if(width > 64) {
+        // The right word gets what spilled out of the left one, or the whole
+        // sprite when it starts there
+        if(x_coord < 64) {
+            collision |= chip8_blit_word(&c->display[1][y_coord], rows, n, 0, 64 - x_coord);
+        } else {
+            collision |= chip8_blit_word(&c->display[1][y_coord], rows, n, x_coord - 64, 0);
+        }
+    }
+
+    c->V[0xF] = collision != 0;
 }
 
-#ifndef NDEBUG
-void print_debug_info(Chip8* c, Inst inst)
+void chip8_op_EX9E(Chip8* c, Inst inst)
 {
-    TraceLog(LOG_INFO, "[ADDR]: 0x%04X [OPCODE]: 0x%04X [EXEC]: ", c->PC - 2, inst.opcode);
-    switch((inst.opcode >> 12) & 0x0F) {
-        case 0x0:
-            {
-                if(inst.NN == 0xE0) {
-                    TraceLog(LOG_INFO, "clear_screen;\n");
-                } else if(inst.NN == 0xEE) {
-                    TraceLog(LOG_INFO, "return %u; \n", *(c->stack - 1));
-                } else {
-                    TraceLog(LOG_INFO, "unimplemented instruction\n");
-                }
-            } break;
-        case 0x1:
-            {
-                TraceLog(LOG_INFO, "jump to NNN(0x%2X)\n", inst.NNN);
-            } break;
-        case 0x2:
-            {
-                TraceLog(LOG_INFO, "jump to NNN(0x%2X) & push PC(0x%2X)\n", inst.NNN, c->PC);
-            } break;
-        case 0x6:
-            {
-                TraceLog(LOG_INFO, "set V%X(0x%02X), NN(0x%02X)\n",
-                        inst.X, c->V[inst.X], inst.NN);
-            } break;
-        case 0x7:
-            {
-                TraceLog(LOG_INFO, "set V%X(0x%02X), += NN(0x%02X)\n",
-                        inst.X, c->V[inst.X], inst.NN);
-            } break;
-        case 0xA:
-            {
-                TraceLog(LOG_INFO, "set I, NNN(0x%04X)\n", inst.NNN);
-            } break;
-        case 0xD:
-            {
-                TraceLog(LOG_INFO, "draw N(%u)-height at V%X(0x%02X), V%X(0x%02X) " 
-                        "from I (0x%04X)\n", inst.N, inst.X, c->V[inst.X],
-                        inst.Y, c->V[inst.Y], c->I);
-            } break;
-        default:
-            {
-                TraceLog(LOG_INFO, "unimplemented instruction\n");
-            } break;
+    if(c->keypad[c->V[inst.X] & 0xF]) {
+        c->PC += 2;
     }
 }
-#endif
 
-void chip8_emulate_instruction(Chip8* c)
+void chip8_op_EXA1(Chip8* c, Inst inst)
 {
-    Inst inst = chip8_fetch_next_instruction(c);
+    if(!c->keypad[c->V[inst.X] & 0xF]) {
+        c->PC += 2;
+    }
+}
 
-#ifndef NDEBUG
-    print_debug_info(c, inst);
-#endif
+void chip8_op_FX07(Chip8* c, Inst inst)
+{
+    c->V[inst.X] = c->delay_timer;
+}
+
+static uint16_t chip8_keys(const Chip8* c)
+{
+    uint16_t keys = 0;
+    for(int i = 0; i < 16; i++) {
+        keys |= (uint16_t)c->keypad[i] << i;
+    }
+    return keys;
+}
 
+void chip8_op_FX0A(Chip8* c, Inst inst)
+{
+    // PC stays on this instruction, chip8_run_frame wakes the instance up
+    // once a key goes down and stops running it until then
+    if(!c->waiting) {
+        c->waiting = true;
+        c->wait_register = inst.X;
+        c->wait_keys = chip8_keys(c);
+    }
+    c->PC -= 2;
+}
+
+void chip8_op_FX15(Chip8* c, Inst inst)
+{
+    c->delay_timer = c->V[inst.X];
+}
+
+void chip8_op_FX18(Chip8* c, Inst inst)
+{
+    c->sound_timer = c->V[inst.X];
+}
+
+void chip8_op_FX1E(Chip8* c, Inst inst)
+{
+    c->I += c->V[inst.X];
+}
+
+void chip8_op_FX29(Chip8* c, Inst inst)
+{
+    // The font is loaded at address 0 and every glyph is 5 bytes tall
+    c->I = (c->V[inst.X] & 0x0F) * 5;
+}
+
+void chip8_op_FX33(Chip8* c, Inst inst)
+{
+    // 0xFX33 Store the BCD of VX at I, I+1 and I+2
+    uint8_t value = c->V[inst.X];
+    chip8_write_ram(c, c->I + 0, value / 100);
+    chip8_write_ram(c, c->I + 1, (value / 10) % 10);
+    chip8_write_ram(c, c->I + 2, value % 10);
+}
+
+void chip8_op_FX55(Chip8* c, Inst inst)
+{
+    for(uint8_t i = 0; i <= inst.X; i++) {
+        chip8_write_ram(c, c->I + i, c->V[i]);
+    }
+}
+
+void chip8_op_FX65(Chip8* c, Inst inst)
+{
+    for(uint8_t i = 0; i <= inst.X; i++) {
+        c->V[i] = c->ram[(c->I + i) % CHIP8_RAM_CAPACITY];
+    }
+}
+
+Chip8_Handler chip8_decode_handler(Inst inst)
+{
     switch((inst.opcode >> 12) & 0x0F) {
         case 0x0:
             {
-                if(inst.NN == 0xE0) {
-                    memset(c->display, false, sizeof(c->display));
-                } else if(inst.NN == 0xEE) {
-                    c->PC = *((uint16_t*)c->stack); // set pc to the top value of the stack
-                    c->stack -= 1;
-                }
-            } break;
-        case 0x1:
-            {
-                c->PC = inst.NNN;
-            } break;
-        case 0x2:
-            {
-                // 0x2NNN Call subroutine at NNN
-                uint16_t* stack_ptr = (uint16_t*)c->stack;
-                *stack_ptr = c->PC; // save current address to to return to on subroutine stack
-                c->PC = inst.NNN; // set program counter to NNN
-                c->stack += 1;
-            } break;
-        case 0x3:
-            {
-                if(c->V[inst.X] == inst.NN) {
-                    c->PC += 1;
-                }
-            } break;
-        case 0x4:
-            {
-                if(c->V[inst.X] != inst.NN) {
-                    c->PC += 1;
-                }
-            } break;
-        case 0x5:
-            {
-                if(c->V[inst.X] == c->V[inst.Y]) {
-                    c->PC += 1;
-                }
-            } break;
-        case 0x6:
-            {
-                c->V[inst.X] = inst.NN;
-            } break;
-        case 0x7:
-            {
-                c->V[inst.X] += inst.NN;
+                if(inst.NN == 0xE0) return chip8_op_00E0;
+                if(inst.NN == 0xEE) return chip8_op_00EE;
+                if(inst.NN == 0xFE) return chip8_op_00FE;
+                if(inst.NN == 0xFF) return chip8_op_00FF;
             } break;
+        case 0x1: return chip8_op_1NNN;
+        case 0x2: return chip8_op_2NNN;
+        case 0x3: return chip8_op_3XNN;
+        case 0x4: return chip8_op_4XNN;
+        case 0x5: return chip8_op_5XY0;
+        case 0x6: return chip8_op_6XNN;
+        case 0x7: return chip8_op_7XNN;
         case 0x8:
             {
                 switch(inst.N) {
-                    case 0x0:
-                        {
-                            c->V[inst.X] = c->V[inst.Y];
-                        } break;
-                    case 0x1:
-                        {
-                            c->V[inst.X] |= c->V[inst.Y];
-                        } break;
-                    case 0x2:
-                        {
-                            c->V[inst.X] &= c->V[inst.Y];
-                        } break;
-                    case 0x3:
-                        {
-                            c->V[inst.X] ^= c->V[inst.Y];
-                        } break;
-                    case 0x4:
-                        {
-                            if(c->V[inst.X] + c->V[inst.Y] > sizeof(uint8_t)) {
-                                c->V[0xF] = 1;
-                            } else {
-                                c->V[0xF] = 0;
-                            }
-                            c->V[inst.X] += c->V[inst.Y];
-                        } break;
-                    case 0x5:
-                        {
-                            if(c->V[inst.X] - c->V[inst.Y] < 0) {
-                                c->V[0xF] = 1;
-                            } else {
-                                c->V[0xF] = 0;
-                            }
-                            c->V[inst.X] += c->V[inst.Y];
-                        } break;
-                    case 0x6:
-                        {
-                            c->V[0xF] = c->V[inst.X] & 0b00000001;
-                            c->V[inst.X] >>= 1;
-                        } break;
-                    case 0x7:
-                        {
-                            if(c->V[inst.Y] - c->V[inst.X] < 0) {
-                                c->V[0xF] = 1;
-                            } else {
-                                c->V[0xF] = 0;
-                            }
-                            c->V[inst.X] = c->V[inst.Y] - c->V[inst.X];
-                        } break;
-                    case 0xE:
-                        {
-                            c->V[0xF] = c->V[inst.X] & 0b10000000;
-                            c->V[inst.X] <<= 1;
-                        } break;
-                    default:
-                        {
-                        } break;
+                    case 0x0: return chip8_op_8XY0;
+                    case 0x1: return chip8_op_8XY1;
+                    case 0x2: return chip8_op_8XY2;
+                    case 0x3: return chip8_op_8XY3;
+                    case 0x4: return chip8_op_8XY4;
+                    case 0x5: return chip8_op_8XY5;
+                    case 0x6: return chip8_op_8XY6;
+                    case 0x7: return chip8_op_8XY7;
+                    case 0xE: return chip8_op_8XYE;
+                    default: break;
                 }
             } break;
-        case 0x9:
+        case 0x9: return chip8_op_9XY0;
+        case 0xA: return chip8_op_ANNN;
+        case 0xB: return chip8_op_BNNN;
+        case 0xC: return chip8_op_CXNN;
+        case 0xD: return chip8_op_DXYN;
+        case 0xE:
             {
-                if(c->V[inst.X] != c->V[inst.Y]) {
-                    c->PC += 1;
-                }
+                if(inst.NN == 0x9E) return chip8_op_EX9E;
+                if(inst.NN == 0xA1) return chip8_op_EXA1;
             } break;
-        case 0xA:
+        case 0xF:
             {
-                c->I = inst.NNN;
-            } break;
-        case 0xB:
-            {
-                c->PC = c->V[0] + inst.NNN;
-            } break;
-        case 0xC:
-            {
-                c->V[inst.X] = (uint8_t)GetRandomValue(0, (int)sizeof(uint8_t)) & inst.NN;
-            } break;
-        case 0xD:
-            {
-                // 0xDXYN Draw N height sprite at coords X,Y; Read from memory
-                // Screen pixels is XOR'd with sprite bits
-                // location I. VF (Carry flag) is set if any screen pixels
-                // are set off 
-                uint8_t x_coord = c->V[inst.X] % CHIP8_DEFAULT_WINDOW_WIDTH;
-                uint8_t y_coord = c->V[inst.Y] % CHIP8_DEFAULT_WINDOW_HEIGHT;
-                const uint8_t x_orig = x_coord;
-
-                c->V[0xF] = 0;
-
-                for(uint8_t i = 0; i < inst.N; i++) {
-                    const uint8_t sprite_data = c->ram[c->I + i];
-                    x_coord = x_orig;
-
-                    for(int8_t j = 7; j >= 0; j--) {
-                        // If sprite pixel/bit is on and display pixel is on, set carry flag
-                        uint16_t display_index = y_coord * CHIP8_DEFAULT_WINDOW_WIDTH + x_coord;
-                        const bool sprite_bit = (sprite_data & (1 << j));
-
-                        if(sprite_bit && c->display[display_index]) {
-                            c->V[0xF] = 1;
-                        }
-
-                        c->display[display_index] ^= sprite_bit;
-
-                        // stop drawing if it hit the edge of the screen;
-                        if(++x_coord >= CHIP8_DEFAULT_WINDOW_WIDTH) 
-                            break;
-                    }
-
-                    // stop drawing if it hit the bottom of the screen;
-                    if(++y_coord >= CHIP8_DEFAULT_WINDOW_HEIGHT)
-                        break;
+                switch(inst.NN) {
+                    case 0x07: return chip8_op_FX07;
+                    case 0x0A: return chip8_op_FX0A;
+                    case 0x15: return chip8_op_FX15;
+                    case 0x18: return chip8_op_FX18;
+                    case 0x1E: return chip8_op_FX1E;
+                    case 0x29: return chip8_op_FX29;
+                    case 0x33: return chip8_op_FX33;
+                    case 0x55: return chip8_op_FX55;
+                    case 0x65: return chip8_op_FX65;
+                    default: break;
                 }
             } break;
         default:
             break;
     }
+    return chip8_op_nop;
+}
+
+// Superinstructions, pairs of adjacent opcodes that are common in the inner
+// loops of real ROMs (see the fall-through pairs in the PROFILE=1 report).
+// They have the signature of a handler and run in place of the first one,
+// with PC already past both instructions, the second one comes from the
+// slot's next. Only opcodes that neither jump nor store to RAM can come
+// first, so the second one always runs right after and is never rewritten by
+// the first.
+#define CHIP8_FUSE(first, second) \
+    static void chip8_fused_##first##_##second(Chip8* c, Inst inst) \
+    { \
+        chip8_op_##first(c, inst); \
+        chip8_op_##second(c, c->decoded[(c->PC >> 1) - 2].next); \
+    }
+CHIP8_FUSE(6XNN, 6XNN) // loading coordinates or loop bounds
+CHIP8_FUSE(ANNN, DXYN) // pointing at a sprite and drawing it
+CHIP8_FUSE(7XNN, 3XNN) // counting up to a limit
+CHIP8_FUSE(FX1E, FX65) // indexing into a table and loading from it
+#undef CHIP8_FUSE
+
+Chip8_Handler chip8_fuse(Inst first, Inst second)
+{
+    const Chip8_Handler a = chip8_decode_handler(first);
+    const Chip8_Handler b = chip8_decode_handler(second);
+    if(a == chip8_op_6XNN && b == chip8_op_6XNN) return chip8_fused_6XNN_6XNN;
+    if(a == chip8_op_ANNN && b == chip8_op_DXYN) return chip8_fused_ANNN_DXYN;
+    if(a == chip8_op_7XNN && b == chip8_op_3XNN) return chip8_fused_7XNN_3XNN;
+    if(a == chip8_op_FX1E && b == chip8_op_FX65) return chip8_fused_FX1E_FX65;
+    return NULL;
 }
 
-int main(int argc, const char** argv)
+// Out of line, so the hit path that nearly every instruction takes needs no
+// stack frame
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void chip8_predecode_miss(Chip8* c, Chip8_Decoded* d, uint16_t addr)
 {
-    if(argc < 2) {
-        TraceLog(LOG_FATAL, "USAGE: %s <path to rom>\n", argv[0]);
-        return 69;
+    d->inst = chip8_decode((c->ram[addr] << 8) | c->ram[addr+1]);
+    d->handler = chip8_decode_handler(d->inst);
+    d->run = d->handler;
+    if(d->handler == chip8_op_FX0A) {
+        d->run = NULL;
+    } else if(addr + 2 < CHIP8_RAM_CAPACITY) {
+        d->next = chip8_decode((c->ram[addr+2] << 8) | c->ram[addr+3]);
+        const Chip8_Handler fused = chip8_fuse(d->inst, d->next);
+        if(fused != NULL) d->run = fused;
     }
-    Config conf;
-    Chip8 chip8;
+}
 
-    set_config_from_args(&conf, argc, argv);
+// Returns the cached decoding of the instruction at addr, decoding it on a
+// miss. Only even addresses are cached, odd ones must go through
+// chip8_fetch_next_instruction.
+static inline Chip8_Decoded* chip8_predecode(Chip8* c, uint16_t addr)
+{
+    Chip8_Decoded* d = &c->decoded[addr >> 1];
+    if(d->handler == NULL) {
+        chip8_predecode_miss(c, d, addr);
+    }
+    return d;
+}
 
-    InitWindow(CHIP8_DEFAULT_WINDOW_WIDTH*conf.scale_factor,
-            CHIP8_DEFAULT_WINDOW_HEIGHT*conf.scale_factor,
-            "CHIP-8 Emulator");
+// Called once per frame, both timers count down at 60hz independently of
+// the CPU clock
+void chip8_update_timers(Chip8* c)
+{
+    if(c->delay_timer > 0) c->delay_timer -= 1;
+    if(c->sound_timer > 0) c->sound_timer -= 1;
+}
 
-    if(!chip8_init(&chip8, conf)) {
-        TraceLog(LOG_FATAL, "Failed to create CHIP-8 instance\n");
-        CloseWindow();
-        return 69;
+uint64_t chip8_display_hash(const Chip8* c)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = (hash ^ c->hires) * 0x100000001b3ull;
+    for(uint32_t w = 0; w < (CHIP8_WIDTH(c) + 63) / 64; w++) {
+        for(uint32_t y = 0; y < CHIP8_HEIGHT(c); y++) {
+            // Byte by byte so the result does not depend on endianness
+            for(int b = 56; b >= 0; b -= 8) {
+                hash = (hash ^ ((c->display[w][y] >> b) & 0xFF)) * 0x100000001b3ull;
+            }
+        }
     }
+    return hash;
+}
 
-    while(chip8.state != EMULATOR_QUIT) {
-        PollInputEvents();
-        handle_input(&chip8);
+// A delay timer poll: FX07, then 3XNN on the same register, then a jump back
+// to the FX07. The timer only ticks between frames, so once the loop is
+// entered with the timer anywhere but NN it spins for the rest of the frame
+// and changes nothing but PC and Vx.
+static bool chip8_idle_loop(const Chip8* c, uint16_t addr)
+{
+    if(addr > CHIP8_RAM_CAPACITY - 6) {
+        return false;
+    }
+    const uint8_t* ram = &c->ram[addr];
+    return (ram[0] & 0xF0) == 0xF0 && ram[1] == 0x07
+        && ram[2] == (0x30 | (ram[0] & 0x0F)) && ram[3] != c->delay_timer
+        && ram[4] == (0x10 | (addr >> 8)) && ram[5] == (addr & 0xFF);
+}
+
+// Skips the instructions an idle loop would spin through in the rest of the
+// frame and returns how many that was. Whole iterations are skipped, the
+// leftover ones still run, so PC, Vx and the cycle count end up exactly as if
+// every instruction had executed.
+static uint64_t chip8_skip_idle(Chip8* c, uint64_t count)
+{
+#ifndef NDEBUG
+    if(c->trace != NULL) return 0;
+#endif
+#ifdef CHIP8_PROFILE
+    if(c->profile != NULL) return 0;
+#endif
+    uint64_t executed = 0;
+    // The last frame may have ended partway through the loop, run up to its
+    // top first: from the 3XNN that is two instructions, from the jump one
+    for(uint16_t back = 2; back <= 4; back += 2) {
+        const uint16_t top = (uint16_t)(c->PC - back);
+        if(chip8_idle_loop(c, top)) {
+            for(; c->PC != top && executed < (6u - back) / 2 && executed < count; ++executed) {
+                chip8_emulate_instruction(c);
+            }
+            break;
+        }
+    }
+    if(!chip8_idle_loop(c, c->PC)) {
+        return executed;
+    }
+    const uint64_t iterations = (count - executed) / 3;
+    if(iterations > 0) {
+        c->V[c->ram[c->PC] & 0x0F] = c->delay_timer;
+        executed += 3 * iterations;
+        c->skipped += 3 * iterations;
+    }
+    return executed;
+}
+
+// The first key that went down since the last check lands in Vx and PC
+// moves past the FX0A
+bool chip8_wait_key(Chip8* c)
+{
+    if(!c->waiting) {
+        return false;
+    }
+    const uint16_t keys = chip8_keys(c);
+    const uint16_t pressed = keys & ~c->wait_keys;
+    c->wait_keys = keys;
+    if(pressed == 0) {
+        return true;
+    }
+    uint8_t key = 0;
+    while(((pressed >> key) & 1) == 0) key++;
+    c->V[c->wait_register] = key;
+    c->PC += 2;
+    c->waiting = false;
+    return false;
+}
+
+bool chip8_blocked(const Chip8* c)
+{
+    return c->waiting && c->delay_timer == 0 && c->sound_timer == 0;
+}
+
+uint64_t chip8_run_frame(Chip8* c, uint64_t count)
+{
+    if(c->host.input != NULL) {
+        c->host.input(c->host.user, c->keypad);
+    }
+    if(c->replay != NULL) {
+        chip8_replay_input(c);
+    }
+
+    // Blocked, the FX0A would only run itself again for the whole frame
+    uint64_t executed = count;
+    if(chip8_wait_key(c)) {
+        c->skipped += count;
+    } else {
+#ifdef CHIP8_PROFILE
+        const uint64_t start = chip8_profile_now();
+#endif
+        executed = chip8_skip_idle(c, count);
+        executed += chip8_run(c, count - executed);
+#ifdef CHIP8_PROFILE
+        if(c->profile != NULL) {
+            chip8_profile_frame(c->profile, executed, chip8_profile_now() - start);
+        }
+#endif
+        // The runner stopped on an FX0A, which would spin for the rest
+        if(c->waiting) {
+            c->skipped += count - executed;
+            executed = count;
+        }
+    }
+    c->cycles += executed;
+    chip8_update_timers(c);
+
+    // The host only hears about the tone starting and stopping
+    const bool beeping = c->sound_timer > 0;
+    if(beeping != c->beeping && c->host.audio != NULL) {
+        c->host.audio(c->host.user, beeping);
+    }
+    c->beeping = beeping;
+    return executed;
+}
+
+void chip8_emulate_instruction(Chip8* c)
+{
+    Inst inst;
+    Chip8_Handler handler;
+#if defined(CHIP8_PROFILE) || !defined(NDEBUG)
+    const uint16_t pc = c->PC;
+#endif
+
+    if((c->PC & 1) == 0 && c->PC < CHIP8_RAM_CAPACITY) {
+        const Chip8_Decoded* d = chip8_predecode(c, c->PC);
+        inst = d->inst;
+        handler = d->handler;
+        c->PC += 2;
+    } else {
+        inst = chip8_fetch_next_instruction(c);
+        handler = chip8_decode_handler(inst);
+    }
+
+#ifndef NDEBUG
+    if(c->trace != NULL) {
+        chip8_trace_append(c, pc, inst.opcode);
+    }
+#endif
+#ifdef CHIP8_PROFILE
+    if(c->profile != NULL) {
+        Chip8_Profile* p = c->profile;
+        p->by_opcode[inst.opcode]++;
+        p->by_pc[pc % CHIP8_RAM_CAPACITY]++;
+        if(pc == (uint16_t)(p->last_pc + 2)) p->by_fallthrough[p->last_pc % CHIP8_RAM_CAPACITY]++;
+        p->last_pc = pc;
+    }
+#endif
+
+    handler(c, inst);
+}
 
-        if(chip8.state == EMULATOR_PAUSED)
+// Runs up to count instructions through the portable switch/predecode path
+// and returns how many were executed. Unlike chip8_emulate_instruction this
+// takes the superinstructions, except while something watches every single
+// instruction.
+uint64_t chip8_run_switch(Chip8* c, uint64_t count)
+{
+    uint64_t executed = 0;
+    bool fuse = true;
+#ifndef NDEBUG
+    fuse = fuse && c->trace == NULL;
+#endif
+#ifdef CHIP8_PROFILE
+    fuse = fuse && c->profile == NULL;
+#endif
+    // A pair never overshoots, the last instruction goes on its own
+    while(fuse && count - executed >= 2) {
+        const uint16_t pc = c->PC;
+        if((pc & 1) != 0 || pc >= CHIP8_RAM_CAPACITY) {
+            chip8_emulate_instruction(c);
+            executed++;
             continue;
+        }
+        const Chip8_Decoded* d = chip8_predecode(c, pc);
+        // Every fetch waits for the PC stored before it. A branch rather than
+        // pc + 2*length keeps the slot loads out of that chain, and PC is
+        // stored once for a whole pair.
+        if(d->run == d->handler) {
+            c->PC = (uint16_t)(pc + 2);
+            d->handler(c, d->inst);
+            executed += 1;
+        } else if(d->run == NULL) {
+            // FX0A, it blocks until chip8_wait_key sees a key
+            c->PC = (uint16_t)(pc + 2);
+            d->handler(c, d->inst);
+            return executed + 1;
+        } else {
+            c->PC = (uint16_t)(pc + 4);
+            d->run(c, d->inst);
+            executed += 2;
+        }
+    }
+    while(executed < count && !c->waiting) {
+        chip8_emulate_instruction(c);
+        executed++;
+    }
+    return executed;
+}
+
+#ifdef CHIP8_THREADED_DISPATCH
+// Direct-threaded interpreter. Needs the labels-as-values extension of
+// GCC/Clang, so it is only compiled when CHIP8_THREADED_DISPATCH is defined.
+// Every handler label ends with its own copy of the dispatch sequence, which
+// gives the branch predictor one indirect jump per opcode instead of a single
+// shared one.
+
+typedef enum {
+#define X(name) CHIP8_OP_##name,
+    CHIP8_OPS(X)
+#undef X
+    CHIP8_OP_COUNT,
+} Chip8_Op;
+
+static uint8_t chip8_op_table[0x10000]; // opcode -> Chip8_Op
+static once_flag chip8_op_table_once = ONCE_FLAG_INIT;
 
-        chip8_emulate_instruction(&chip8);
+static void chip8_op_table_fill(void)
+{
+    const Chip8_Handler handlers[CHIP8_OP_COUNT] = {
+#define X(name) chip8_op_##name,
+        CHIP8_OPS(X)
+#undef X
+    };
 
-        update_screen(&chip8, conf);
+    for(uint32_t opcode = 0; opcode < 0x10000; ++opcode) {
+        Chip8_Handler h = chip8_decode_handler(chip8_decode((uint16_t)opcode));
+        uint8_t op = CHIP8_OP_nop;
+        for(uint8_t i = 0; i < CHIP8_OP_COUNT; ++i) {
+            if(handlers[i] == h) {
+                op = i;
+                break;
+            }
+        }
+        chip8_op_table[opcode] = op;
     }
+}
 
-    CloseWindow();
-    return 0;
+// Fills the opcode table, must be called before chip8_run_threaded. Batch
+// and conform workers get here from chip8_init at the same time.
+void chip8_threaded_init(void)
+{
+    call_once(&chip8_op_table_once, chip8_op_table_fill);
 }
+
+#ifndef NDEBUG
+#define CHIP8_THREADED_TRACE() \
+    do { if(c->trace != NULL) chip8_trace_append(c, c->PC - 2, opcode); } while(0)
+#else
+#define CHIP8_THREADED_TRACE() (void)0
+#endif
+
+#define CHIP8_DISPATCH() \
+    do { \
+        if(executed == count) return executed; \
+        executed++; \
+        opcode = (c->ram[c->PC & CHIP8_ADDRESS_MASK] << 8) | c->ram[(c->PC + 1) & CHIP8_ADDRESS_MASK]; \
+        c->PC += 2; \
+        CHIP8_THREADED_TRACE(); \
+        goto *labels[chip8_op_table[opcode]]; \
+    } while(0)
+
+uint64_t chip8_run_threaded(Chip8* c, uint64_t count)
+{
+    static const void* const labels[CHIP8_OP_COUNT] = {
+#define X(name) &&op_##name,
+        CHIP8_OPS(X)
+#undef X
+    };
+    uint64_t executed = 0;
+    uint16_t opcode;
+
+    CHIP8_DISPATCH();
+
+    // Fields are decoded inside each handler so only the ones it uses are
+    // computed. FX0A blocks and ends the run, the check folds away in every
+    // other handler.
+#define X(name) op_##name: chip8_op_##name(c, chip8_decode(opcode)); \
+    if(CHIP8_OP_##name == CHIP8_OP_FX0A) return executed; \
+    CHIP8_DISPATCH();
+    CHIP8_OPS(X)
+#undef X
+
+    return executed;
+}
+
+#undef CHIP8_DISPATCH
+#undef CHIP8_THREADED_TRACE
+#endif // CHIP8_THREADED_DISPATCH
+
+uint64_t chip8_run(Chip8* c, uint64_t count)
+{
+#ifdef CHIP8_PROFILE
+    // Only chip8_emulate_instruction counts
+    return chip8_run_switch(c, count);
+#endif
+#ifdef CHIP8_AOT
+    if(c->aot)
+        return chip8_run_aot(c, count);
+#endif
+#ifdef CHIP8_JIT
+    if(c->jit != NULL)
+        return chip8_run_jit(c, count);
+#endif
+#ifdef CHIP8_THREADED_DISPATCH
+    return chip8_run_threaded(c, count);
+#else
+    return chip8_run_switch(c, count);
+#endif
+}
+
@@ -0,0 +1,344 @@
+#ifndef CHIP8_H_
+#define CHIP8_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Core of the emulator. Nothing in here depends on raylib, everything the
+// core needs from its host goes through Chip8_Host.
+
+#define CHIP8_DEFAULT_WINDOW_WIDTH 64
+#define CHIP8_DEFAULT_WINDOW_HEIGHT 32
+#define CHIP8_HIRES_WIDTH 128 // SCHIP high resolution mode, see 00FF
+#define CHIP8_HIRES_HEIGHT 64
+#define CHIP8_DISPLAY_WORDS (CHIP8_HIRES_WIDTH/64)
+#define CHIP8_FRAME_RATE 60 // timers tick and the screen is presented at this rate
+#define CHIP8_DEFAULT_CPU_HZ 700
+#define CHIP8_DEFAULT_SEED 0x2545F491 // see chip8_seed
+
+typedef enum {
+    EMULATOR_QUIT = 0,
+    EMULATOR_RUNNING,
+    EMULATOR_PAUSED,
+} Emulator_State;
+
+#define CHIP8_RAM_CAPACITY 0x1000
+#define CHIP8_STACK_B 0xEA0
+#define CHIP8_STACK_E 0xEFF
+#define CHIP8_STACK_SIZE (CHIP8_STACK_E - CHIP8_STACK_B)
+// Return addresses that fit, a deeper 2NNN wraps around and overwrites the
+// oldest one instead of running into the rest of the RAM
+#define CHIP8_STACK_DEPTH ((CHIP8_STACK_SIZE + 1) / 2)
+#define CHIP8_ADDRESS_MASK (CHIP8_RAM_CAPACITY - 1) // PC and I are 12 bits wide
+#define CHIP8_ROM_B 0x200
+
+typedef struct {
+    uint16_t opcode;
+    uint8_t X; // the 2nd nibble of the opcode
+    uint8_t Y; // the 3rd nibble of the opcode
+    uint8_t N; // the 4th nibble of the opcode
+    uint8_t NN; // Y and N combined or the second byte (8 bit)
+    uint16_t NNN; // X, Y and N combined (12bit)
+} Inst;
+
+typedef enum {
+    CHIP8_LOG_DEBUG = 0,
+    CHIP8_LOG_INFO,
+    CHIP8_LOG_WARNING,
+    CHIP8_LOG_ERROR,
+} Chip8_Log_Level;
+
+// Callbacks into whatever runs the core. Any of them can be left NULL, random
+// then falls back to the seeded generator of the instance (see chip8_seed),
+// log to stderr, input and audio do nothing. A host that wants reproducible
+// runs leaves random NULL.
+typedef struct {
+    void* user; // passed back to every callback
+    uint8_t (*random)(void* user); // source of CXNN
+    void (*log)(void* user, Chip8_Log_Level level, const char* message);
+    void (*input)(void* user, bool keypad[16]); // refresh the keypad, once per frame
+    void (*audio)(void* user, bool on); // the sound timer started or stopped
+} Chip8_Host;
+
+typedef struct Chip8 Chip8;
+typedef struct Chip8_Jit Chip8_Jit;
+typedef struct Chip8_Replay Chip8_Replay;
+typedef struct Chip8_Profile Chip8_Profile;
+typedef struct Chip8_Trace Chip8_Trace;
+typedef void (*Chip8_Handler)(Chip8* c, Inst inst);
+
+// One slot of the predecode cache. A NULL handler marks the slot as empty,
+// either because it was never fetched or because RAM under it was written.
+// run is what chip8_run_switch calls: a superinstruction that also runs the
+// next instruction, decoded in next, when chip8_fuse has one for the pair,
+// NULL for FX0A, which ends the run, handler otherwise.
+typedef struct {
+    Inst inst;
+    Chip8_Handler handler;
+    Chip8_Handler run;
+    Inst next;
+} Chip8_Decoded;
+
+struct Chip8 {
+    Emulator_State state;
+    uint8_t ram[CHIP8_RAM_CAPACITY];
+    uint64_t display[CHIP8_DISPLAY_WORDS][CHIP8_HIRES_HEIGHT]; // see CHIP8_PIXEL
+    bool hires; // 128x64 SCHIP mode, 64x32 otherwise
+    uint64_t dirty_rows; // bit y set when display row y changed since last presented
+    uint16_t* stack;
+    uint8_t V[16]; // registers
+    uint16_t I; // index registers
+    uint16_t PC; // Program Counter
+    uint8_t delay_timer; // Decrements at 60hz when > 0
+    uint8_t sound_timer; // Decrements at 60hz and plays tone when > 0
+    bool keypad[16]; // 0x0 0xF
+    bool waiting; // blocked in the FX0A at PC until a key goes down
+    uint8_t wait_register; // X of that FX0A
+    uint16_t wait_keys; // keys down at the last check, they have to be released first
+    bool beeping; // sound timer was running at the end of the last frame
+    uint32_t rng; // xorshift32 state behind CXNN, never 0
+    uint64_t cycles; // instructions executed through chip8_run_frame
+    uint64_t skipped; // part of cycles counted without running (idle loops, FX0A), not saved
+    Chip8_Host host;
+    Chip8_Replay* replay; // records or plays back the keypad, see chip8_replay.c
+    Chip8_Decoded decoded[CHIP8_RAM_CAPACITY/2]; // one slot per even address
+    uint64_t written[CHIP8_RAM_CAPACITY/64]; // RAM bytes stored to since chip8_init
+#ifdef CHIP8_JIT
+    Chip8_Jit* jit; // NULL unless chip8_jit_init succeeded
+#endif
+#ifdef CHIP8_AOT
+    bool aot; // run the linked-in translation of this ROM
+#endif
+#ifdef CHIP8_PROFILE
+    Chip8_Profile* profile; // created by chip8_init
+#endif
+#ifndef NDEBUG
+    Chip8_Trace* trace; // NULL unless chip8_trace_start was called
+#endif
+};
+
+// The display is split into 64 pixel wide columns of words, display[w][y]
+// holds pixels 64*w to 64*w+63 of row y with the leftmost pixel in the most
+// significant bit. Low resolution mode only uses the top-left 64x32 of
+// display[0].
+#define CHIP8_PIXEL(c, x, y) (((c)->display[(x) / 64][(y)] >> (63 - (x) % 64)) & 1)
+#define CHIP8_WIDTH(c) ((c)->hires ? CHIP8_HIRES_WIDTH : CHIP8_DEFAULT_WINDOW_WIDTH)
+#define CHIP8_HEIGHT(c) ((c)->hires ? CHIP8_HIRES_HEIGHT : CHIP8_DEFAULT_WINDOW_HEIGHT)
+
+// host may be NULL. The ROM is loaded separately, see chip8_load_rom.
+bool chip8_init(Chip8* c, const Chip8_Host* host);
+void chip8_deinit(Chip8* c);
+bool chip8_load_rom(Chip8* c, const uint8_t* rom, size_t size);
+bool chip8_load_rom_file(Chip8* c, const char* path);
+// Restarts the generator behind CXNN, a seed of 0 is replaced by
+// CHIP8_DEFAULT_SEED. chip8_init seeds with CHIP8_DEFAULT_SEED.
+void chip8_seed(Chip8* c, uint32_t seed);
+uint8_t chip8_random(Chip8* c);
+void chip8_log(const Chip8* c, Chip8_Log_Level level, const char* fmt, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 3, 4)))
+#endif
+    ;
+// Every heap allocation of the core goes through these. chip8_allocations
+// reports how many were made and how many bytes they asked for since the
+// process started, over all instances and threads.
+void* chip8_malloc(size_t size);
+void* chip8_calloc(size_t count, size_t size);
+void* chip8_realloc(void* p, size_t size);
+void chip8_free(void* p);
+void chip8_allocations(uint64_t* count, uint64_t* bytes);
+
+Inst chip8_decode(uint16_t opcode);
+Inst chip8_fetch_next_instruction(Chip8* c);
+Chip8_Handler chip8_decode_handler(Inst inst);
+// The superinstruction running first and then second, NULL if the pair is
+// not one of the fused ones
+Chip8_Handler chip8_fuse(Inst first, Inst second);
+void chip8_invalidate(Chip8* c, uint16_t addr);
+void chip8_write_ram(Chip8* c, uint16_t addr, uint8_t value);
+// True when any byte in [begin, end) was stored to since chip8_init
+bool chip8_ram_written(const Chip8* c, uint16_t begin, uint16_t end);
+void chip8_emulate_instruction(Chip8* c);
+void chip8_update_timers(Chip8* c);
+// FNV-1a over the visible part of the display and the resolution, stable
+// across builds and hosts
+uint64_t chip8_display_hash(const Chip8* c);
+
+// Save states, see chip8_state.c for the format. chip8_save_state returns the
+// snapshot size, or 0 when capacity is smaller than chip8_state_size(c).
+#define CHIP8_STATE_VERSION 3
+#define CHIP8_STATE_HEADER_SIZE 49
+#define CHIP8_STATE_MAX_SIZE (CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY + CHIP8_DISPLAY_WORDS*CHIP8_HIRES_HEIGHT*8)
+size_t chip8_state_size(const Chip8* c);
+size_t chip8_save_state(const Chip8* c, uint8_t* out, size_t capacity);
+bool chip8_load_state(Chip8* c, const uint8_t* in, size_t size);
+uint64_t chip8_state_hash(const uint8_t* state, size_t size);
+
+// Rewind history, see chip8_rewind.c. budget is the total memory in bytes the
+// history may use, NULL is returned when it cannot hold a single frame. Push
+// once per frame, pop restores the frame before the newest one pushed and
+// returns false once the history is exhausted.
+typedef struct Chip8_Rewind Chip8_Rewind;
+Chip8_Rewind* chip8_rewind_create(size_t budget);
+void chip8_rewind_destroy(Chip8_Rewind* r);
+void chip8_rewind_clear(Chip8_Rewind* r);
+void chip8_rewind_push(Chip8_Rewind* r, const Chip8* c);
+bool chip8_rewind_pop(Chip8_Rewind* r, Chip8* c);
+size_t chip8_rewind_frames(const Chip8_Rewind* r);
+size_t chip8_rewind_used(const Chip8_Rewind* r);
+
+// Input recording and playback, see chip8_replay.c for the file format. A
+// replay holds the ROM, the seed of CXNN and every keypad change with the
+// value of c->cycles it happened at. Attach one with chip8_replay_record or
+// chip8_replay_play right after chip8_init, chip8_run_frame then records the
+// keypad the host reports or overrides it with the recorded one.
+typedef struct {
+    uint64_t cycle;
+    uint16_t keys; // bit n set while key n is down
+} Chip8_Replay_Event;
+
+struct Chip8_Replay {
+    uint32_t seed;
+    uint32_t instructions_per_frame; // playback must use the same
+    uint64_t cycles; // length of the run
+    uint64_t state_hash; // chip8_state_hash at the end of the run
+    uint8_t* rom;
+    size_t rom_size;
+    Chip8_Replay_Event* events;
+    size_t count, capacity;
+    size_t next; // playback position in events
+    bool playing;
+};
+
+// Loads the ROM into c and starts recording
+bool chip8_replay_record(Chip8* c, Chip8_Replay* r, const uint8_t* rom, size_t size,
+        uint32_t seed, uint32_t instructions_per_frame);
+// Loads the recorded ROM into c and starts playing r back
+bool chip8_replay_play(Chip8* c, Chip8_Replay* r);
+// Stops recording, stamps the length and final state of the run into r
+void chip8_replay_finish(Chip8* c, Chip8_Replay* r);
+// Called by chip8_run_frame after the host refreshed the keypad
+void chip8_replay_input(Chip8* c);
+void chip8_replay_free(Chip8_Replay* r);
+bool chip8_replay_save(const Chip8* c, const Chip8_Replay* r, const char* path);
+bool chip8_replay_load(const Chip8* c, Chip8_Replay* r, const char* path);
+// Final state hash of c, the value a replay is checked against
+uint64_t chip8_replay_hash(const Chip8* c);
+
+// Instruction trace, see chip8_trace.c. Tracing only exists in debug builds,
+// the disassembler everywhere.
+typedef struct {
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t I; // before the instruction ran
+    uint16_t changed; // bit x set when the instruction changed Vx
+} Chip8_Trace_Record;
+#ifndef NDEBUG
+// capacity is rounded up to a power of two
+bool chip8_trace_start(Chip8* c, size_t capacity);
+void chip8_trace_stop(Chip8* c);
+void chip8_trace_append(Chip8* c, uint16_t pc, uint16_t opcode);
+// Publishes the newest record, which otherwise waits for the next instruction
+void chip8_trace_flush(Chip8* c);
+// Copies up to max of the newest records, oldest first, can be called from
+// any thread. first receives the sequence number of out[0].
+size_t chip8_trace_snapshot(const Chip8* c, Chip8_Trace_Record* out, size_t max, uint64_t* first);
+bool chip8_trace_write(Chip8* c, const char* path);
+#endif
+// Writes the mnemonic of opcode to out like snprintf and returns its length
+size_t chip8_disassemble(uint16_t opcode, char* out, size_t size);
+
+#ifdef CHIP8_PROFILE
+// Execution counters, see chip8_profile.c. Only exists with -DCHIP8_PROFILE,
+// uses of it belong under the same #ifdef.
+#define CHIP8_PROFILE_MAX_TOP 64
+struct Chip8_Profile {
+    uint64_t by_opcode[0x10000];
+    uint64_t by_pc[CHIP8_RAM_CAPACITY];
+    uint64_t by_fallthrough[CHIP8_RAM_CAPACITY]; // address ran and then the one after it
+    uint16_t last_pc;
+    uint64_t frames, frame_instructions;
+    uint64_t frame_ns, frame_min_ns, frame_max_ns; // host time spent in chip8_run_frame
+};
+Chip8_Profile* chip8_profile_create(void);
+void chip8_profile_destroy(Chip8_Profile* p);
+void chip8_profile_reset(Chip8_Profile* p);
+uint64_t chip8_profile_now(void);
+void chip8_profile_frame(Chip8_Profile* p, uint64_t instructions, uint64_t ns);
+// Logs the top entries of every table, largest first
+void chip8_profile_report(const Chip8* c, size_t top);
+#endif
+
+// Every opcode handler, in a fixed order. The handlers are exported so that
+// code generated by chip8-aot can call them directly.
+#define CHIP8_OPS(X) \
+    X(nop) X(00E0) X(00EE) X(00FE) X(00FF) X(1NNN) X(2NNN) X(3XNN) \
+    X(4XNN) X(5XY0) X(6XNN) X(7XNN) X(8XY0) X(8XY1) X(8XY2) X(8XY3) \
+    X(8XY4) X(8XY5) X(8XY6) X(8XY7) X(8XYE) X(9XY0) X(ANNN) X(BNNN) \
+    X(CXNN) X(DXYN) X(EX9E) X(EXA1) X(FX07) X(FX0A) X(FX15) X(FX18) \
+    X(FX1E) X(FX29) X(FX33) X(FX55) X(FX65)
+
+#define X(name) void chip8_op_##name(Chip8* c, Inst inst);
+CHIP8_OPS(X)
+#undef X
+
+// Each runner executes up to count instructions and returns how many it did,
+// fewer when an FX0A blocks, which it leaves PC on
+uint64_t chip8_run(Chip8* c, uint64_t count);
+uint64_t chip8_run_switch(Chip8* c, uint64_t count);
+// One 60hz frame: refresh the keypad through the host, run count
+// instructions, tick the timers and report sound changes. A loop polling the
+// delay timer is not run instruction by instruction, the frame jumps to the
+// next tick with the state and cycle count it would have had. The frame ends
+// at an FX0A that blocks, and an instance blocked in FX0A runs nothing until
+// a key goes down. Such frames still count count cycles, like the FX0A
+// spinning on itself would.
+uint64_t chip8_run_frame(Chip8* c, uint64_t count);
+// Blocked in FX0A with both timers run out, every frame is the same until a
+// key goes down so a host can stop running frames until then
+bool chip8_blocked(const Chip8* c);
+// Ends an FX0A wait when a key went down since the last check, the part of
+// chip8_run_frame a runner driven without it has to call after setting the
+// keypad. Returns true while the instance stays blocked.
+bool chip8_wait_key(Chip8* c);
+
+// Lockstep structure-of-arrays engine, see chip8_soa.c. Holds many instances
+// (lanes) of one ROM and executes every opcode once for all lanes sharing a
+// PC. Lanes start as copies of the prototype, chip8_soa_write/read move a
+// full state in and out of a lane.
+typedef struct Chip8_Soa Chip8_Soa;
+Chip8_Soa* chip8_soa_create(const Chip8* prototype, uint32_t lanes);
+void chip8_soa_destroy(Chip8_Soa* s);
+uint32_t chip8_soa_lanes(const Chip8_Soa* s);
+void chip8_soa_read(const Chip8_Soa* s, uint32_t lane, Chip8* out);
+void chip8_soa_write(Chip8_Soa* s, uint32_t lane, const Chip8* in);
+// Sets the keys a lane sees down from the next chip8_step_batch on
+void chip8_soa_input(Chip8_Soa* s, uint32_t lane, const bool keypad[16]);
+// Every lane executes steps instructions, returns the lane-steps done. A lane
+// blocked in FX0A is woken first, like chip8_run_frame does.
+uint64_t chip8_step_batch(Chip8_Soa* s, uint64_t steps);
+void chip8_soa_update_timers(Chip8_Soa* s);
+
+#ifdef CHIP8_THREADED_DISPATCH
+void chip8_threaded_init(void);
+uint64_t chip8_run_threaded(Chip8* c, uint64_t count);
+#endif
+
+#ifdef CHIP8_JIT
+// x86-64 dynamic recompiler, see chip8_jit.c. chip8_jit_init returns false
+// when the host cannot run it, the interpreter keeps working in that case.
+bool chip8_jit_init(Chip8* c);
+void chip8_jit_deinit(Chip8* c);
+void chip8_jit_invalidate(Chip8* c, uint16_t addr);
+uint64_t chip8_run_jit(Chip8* c, uint64_t count);
+#endif
+
+#ifdef CHIP8_AOT
+// Provided by a translation unit generated with chip8-aot. chip8_aot_matches
+// tells whether c holds the ROM that translation was made from.
+bool chip8_aot_matches(const Chip8* c);
+uint64_t chip8_run_aot(Chip8* c, uint64_t count);
+#endif
+
+#endif // CHIP8_H_
@@ -0,0 +1,561 @@
+// x86-64 dynamic recompiler for CHIP-8 basic blocks.
+//
+// A block starts at Chip8.PC and runs until the first control flow opcode
+// (1NNN or one of the skips), or until an opcode the JIT does not translate.
+// 2NNN, 00EE, BNNN, DXYN and everything else not listed in
+// chip8_jit_classify end the block before them and are left to the
+// interpreter. Inside a block every V register it touches, and I, live in
+// host registers. They are loaded in the prologue and only the dirty ones
+// are written back in the epilogue together with the new PC.
+//
+// Only built for x86-64 System V hosts (Linux, BSD). Anywhere else
+// chip8_jit_init just reports that the JIT is not available.
+#include "chip8.h"
+
+#ifdef CHIP8_JIT
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+#define CHIP8_JIT_CODE_CAPACITY (256*1024)
+#define CHIP8_JIT_MAX_BLOCK_LENGTH 32
+#define CHIP8_JIT_SLOT_I 16 // register slot used for I, 0x0-0xF are V0-VF
+
+typedef enum {
+    JIT_BLOCK_UNKNOWN = 0,
+    JIT_BLOCK_COMPILED,
+    JIT_BLOCK_INTERPRET, // the opcode at this address can not start a block
+} Jit_Block_Kind;
+
+typedef void (*Jit_Block_Fn)(Chip8* c);
+
+typedef struct {
+    Jit_Block_Fn entry;
+    uint8_t length; // instructions retired by one run of the block
+    uint8_t kind;
+} Jit_Block;
+
+struct Chip8_Jit {
+    uint8_t* code;
+    size_t code_used;
+    Jit_Block blocks[CHIP8_RAM_CAPACITY/2]; // one per even address
+    bool covered[CHIP8_RAM_CAPACITY]; // bytes translated into some block
+};
+
+#ifdef CHIP8_JIT_SUPPORTED
+
+// Host register numbers as used in ModRM/REX encoding
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// RDI holds the Chip8* for the whole block, RAX and RCX are scratch
+static const uint8_t jit_register_pool[] = {
+    RDX, RSI, R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15,
+};
+#define JIT_POOL_SIZE (sizeof(jit_register_pool)/sizeof(jit_register_pool[0]))
+
+typedef enum {
+    JIT_OP_UNSUPPORTED = 0,
+    JIT_OP_STRAIGHT,
+    JIT_OP_TERMINATOR,
+} Jit_Op_Kind;
+
+typedef struct {
+    uint8_t* p;
+    uint8_t* end;
+    bool overflow;
+} Emitter;
+
+static void emit8(Emitter* e, uint8_t b)
+{
+    if(e->p >= e->end) {
+        e->overflow = true;
+        return;
+    }
+    *e->p++ = b;
+}
+
+static void emit16(Emitter* e, uint16_t v)
+{
+    emit8(e, v & 0xFF);
+    emit8(e, v >> 8);
+}
+
+static void emit32(Emitter* e, uint32_t v)
+{
+    emit16(e, v & 0xFFFF);
+    emit16(e, v >> 16);
+}
+
+// An empty REX (0x40) is always emitted for byte operations so that RSI/RBP
+// encode as SIL/BPL instead of DH/CH
+static void emit_rex(Emitter* e, uint8_t r, uint8_t b)
+{
+    emit8(e, 0x40 | ((r >> 3) << 2) | (b >> 3));
+}
+
+static void emit_modrm_chip8(Emitter* e, uint8_t reg, size_t offset)
+{
+    emit8(e, 0x80 | ((reg & 7) << 3) | RDI); // [rdi + disp32]
+    emit32(e, (uint32_t)offset);
+}
+
+static void emit_modrm_reg(Emitter* e, uint8_t reg, uint8_t rm)
+{
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// movzx r32, byte [rdi + offset]
+static void emit_load_u8(Emitter* e, uint8_t reg, size_t offset)
+{
+    emit_rex(e, reg, 0);
+    emit8(e, 0x0F); emit8(e, 0xB6);
+    emit_modrm_chip8(e, reg, offset);
+}
+
+// movzx r32, word [rdi + offset]
+static void emit_load_u16(Emitter* e, uint8_t reg, size_t offset)
+{
+    emit_rex(e, reg, 0);
+    emit8(e, 0x0F); emit8(e, 0xB7);
+    emit_modrm_chip8(e, reg, offset);
+}
+
+// mov byte [rdi + offset], r8
+static void emit_store_u8(Emitter* e, uint8_t reg, size_t offset)
+{
+    emit_rex(e, reg, 0);
+    emit8(e, 0x88);
+    emit_modrm_chip8(e, reg, offset);
+}
+
+// mov word [rdi + offset], r16
+static void emit_store_u16(Emitter* e, uint8_t reg, size_t offset)
+{
+    emit8(e, 0x66);
+    emit_rex(e, reg, 0);
+    emit8(e, 0x89);
+    emit_modrm_chip8(e, reg, offset);
+}
+
+// mov word [rdi + offset], imm16
+static void emit_store_imm16(Emitter* e, size_t offset, uint16_t imm)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit_modrm_chip8(e, 0, offset);
+    emit16(e, imm);
+}
+
+// mov r8, imm8
+static void emit_mov_imm8(Emitter* e, uint8_t reg, uint8_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xB0 + (reg & 7));
+    emit8(e, imm);
+}
+
+// mov r32, imm32
+static void emit_mov_imm32(Emitter* e, uint8_t reg, uint32_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xB8 + (reg & 7));
+    emit32(e, imm);
+}
+
+// <op> r/m8, imm8 where ext selects the operation (0 add, 7 cmp)
+static void emit_alu_imm8(Emitter* e, uint8_t ext, uint8_t reg, uint8_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0x80);
+    emit_modrm_reg(e, ext, reg);
+    emit8(e, imm);
+}
+
+// <op> dst8, src8 for the r/m8, r8 forms (0x88 mov, 0x08 or, 0x20 and,
+// 0x30 xor, 0x38 cmp)
+static void emit_alu_reg8(Emitter* e, uint8_t opcode, uint8_t dst, uint8_t src)
+{
+    emit_rex(e, src, dst);
+    emit8(e, opcode);
+    emit_modrm_reg(e, src, dst);
+}
+
+// add dst32, src8 (zero extended through RCX)
+static void emit_add_r32_u8(Emitter* e, uint8_t dst, uint8_t src)
+{
+    emit_rex(e, RCX, src);
+    emit8(e, 0x0F); emit8(e, 0xB6);
+    emit_modrm_reg(e, RCX, src);
+    emit_rex(e, RCX, dst);
+    emit8(e, 0x01);
+    emit_modrm_reg(e, RCX, dst);
+}
+
+static void emit_push(Emitter* e, uint8_t reg)
+{
+    if(reg >= R8) emit8(e, 0x41);
+    emit8(e, 0x50 + (reg & 7));
+}
+
+static void emit_pop(Emitter* e, uint8_t reg)
+{
+    if(reg >= R8) emit8(e, 0x41);
+    emit8(e, 0x58 + (reg & 7));
+}
+
+static bool is_callee_saved(uint8_t reg)
+{
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+
+// Returns how the JIT handles inst and which register slots it reads or
+// writes.
+static Jit_Op_Kind chip8_jit_classify(Inst inst, uint8_t* slots, uint8_t* slot_count)
+{
+    *slot_count = 0;
+    switch((inst.opcode >> 12) & 0x0F) {
+        case 0x1:
+            return JIT_OP_TERMINATOR;
+        case 0x3:
+        case 0x4:
+            slots[(*slot_count)++] = inst.X;
+            return JIT_OP_TERMINATOR;
+        case 0x5:
+        case 0x9:
+            slots[(*slot_count)++] = inst.X;
+            slots[(*slot_count)++] = inst.Y;
+            return JIT_OP_TERMINATOR;
+        case 0x6:
+        case 0x7:
+            slots[(*slot_count)++] = inst.X;
+            return JIT_OP_STRAIGHT;
+        case 0x8:
+            if(inst.N > 0x3)
+                return JIT_OP_UNSUPPORTED;
+            slots[(*slot_count)++] = inst.X;
+            slots[(*slot_count)++] = inst.Y;
+            return JIT_OP_STRAIGHT;
+        case 0xA:
+            slots[(*slot_count)++] = CHIP8_JIT_SLOT_I;
+            return JIT_OP_STRAIGHT;
+        case 0xF:
+            switch(inst.NN) {
+                case 0x1E:
+                    slots[(*slot_count)++] = CHIP8_JIT_SLOT_I;
+                    // fallthrough
+                case 0x07:
+                case 0x15:
+                case 0x18:
+                    slots[(*slot_count)++] = inst.X;
+                    return JIT_OP_STRAIGHT;
+                default:
+                    return JIT_OP_UNSUPPORTED;
+            }
+        default:
+            return JIT_OP_UNSUPPORTED;
+    }
+}
+
+// Only forgets the blocks, the buffer itself is not written so it can stay
+// executable until the next block is emitted
+static void chip8_jit_flush(Chip8_Jit* jit)
+{
+    jit->code_used = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->covered, 0, sizeof(jit->covered));
+}
+
+static bool chip8_jit_emit_block(Chip8* c, Chip8_Jit* jit, uint16_t start, Emitter* e)
+{
+    Inst insts[CHIP8_JIT_MAX_BLOCK_LENGTH];
+    uint8_t length = 0;
+    bool terminated = false;
+
+    int8_t host[CHIP8_JIT_SLOT_I + 1];
+    bool dirty[CHIP8_JIT_SLOT_I + 1] = {0};
+    uint8_t used = 0;
+    memset(host, -1, sizeof(host));
+
+    // Pass 1: find the block and give every slot it touches a host register
+    uint16_t addr = start;
+    while(length < CHIP8_JIT_MAX_BLOCK_LENGTH && addr + 1 < CHIP8_RAM_CAPACITY) {
+        Inst inst = chip8_decode((c->ram[addr] << 8) | c->ram[addr+1]);
+        uint8_t slots[2], slot_count, fresh = 0;
+        Jit_Op_Kind kind = chip8_jit_classify(inst, slots, &slot_count);
+        if(kind == JIT_OP_UNSUPPORTED)
+            break;
+        for(uint8_t i = 0; i < slot_count; ++i)
+            if(host[slots[i]] < 0 && (i == 0 || slots[i] != slots[0]))
+                fresh++;
+        if(used + fresh > JIT_POOL_SIZE)
+            break;
+        for(uint8_t i = 0; i < slot_count; ++i)
+            if(host[slots[i]] < 0)
+                host[slots[i]] = jit_register_pool[used++];
+
+        insts[length++] = inst;
+        addr += 2;
+        if(kind == JIT_OP_TERMINATOR) {
+            terminated = true;
+            break;
+        }
+    }
+
+    if(length == 0)
+        return false;
+
+    // Pass 2: emit
+    for(uint8_t i = 0; i < used; ++i)
+        if(is_callee_saved(jit_register_pool[i]))
+            emit_push(e, jit_register_pool[i]);
+    for(uint8_t s = 0; s < CHIP8_JIT_SLOT_I; ++s)
+        if(host[s] >= 0)
+            emit_load_u8(e, host[s], offsetof(Chip8, V) + s);
+    if(host[CHIP8_JIT_SLOT_I] >= 0)
+        emit_load_u16(e, host[CHIP8_JIT_SLOT_I], offsetof(Chip8, I));
+
+    uint8_t straight = terminated ? length - 1 : length;
+    for(uint8_t i = 0; i < straight; ++i) {
+        Inst inst = insts[i];
+        uint8_t vx = host[inst.X];
+        switch((inst.opcode >> 12) & 0x0F) {
+            case 0x6:
+                emit_mov_imm8(e, vx, inst.NN);
+                dirty[inst.X] = true;
+                break;
+            case 0x7:
+                emit_alu_imm8(e, 0, vx, inst.NN);
+                dirty[inst.X] = true;
+                break;
+            case 0x8:
+                {
+                    const uint8_t opcodes[] = { 0x88, 0x08, 0x20, 0x30 };
+                    emit_alu_reg8(e, opcodes[inst.N], vx, host[inst.Y]);
+                    dirty[inst.X] = true;
+                } break;
+            case 0xA:
+                emit_mov_imm32(e, host[CHIP8_JIT_SLOT_I], inst.NNN);
+                dirty[CHIP8_JIT_SLOT_I] = true;
+                break;
+            case 0xF:
+                switch(inst.NN) {
+                    case 0x07:
+                        emit_load_u8(e, vx, offsetof(Chip8, delay_timer));
+                        dirty[inst.X] = true;
+                        break;
+                    case 0x15:
+                        emit_store_u8(e, vx, offsetof(Chip8, delay_timer));
+                        break;
+                    case 0x18:
+                        emit_store_u8(e, vx, offsetof(Chip8, sound_timer));
+                        break;
+                    case 0x1E:
+                        // only the low 16 bits are ever stored back, so I
+                        // wraps like the uint16_t it mirrors
+                        emit_add_r32_u8(e, host[CHIP8_JIT_SLOT_I], vx);
+                        dirty[CHIP8_JIT_SLOT_I] = true;
+                        break;
+                }
+                break;
+        }
+    }
+
+    // The skips compute the next PC into AX before the write-back, the
+    // moves of the write-back leave the flags alone anyway.
+    bool pc_in_rax = false;
+    uint16_t next_pc = addr;
+    if(terminated) {
+        Inst inst = insts[length - 1];
+        uint8_t top = (inst.opcode >> 12) & 0x0F;
+        if(top == 0x1) {
+            next_pc = inst.NNN;
+        } else {
+            emit8(e, 0x31); emit8(e, 0xC9); // xor ecx, ecx
+            if(top == 0x3 || top == 0x4)
+                emit_alu_imm8(e, 7, host[inst.X], inst.NN);
+            else
+                emit_alu_reg8(e, 0x38, host[inst.X], host[inst.Y]);
+            emit8(e, 0x0F);
+            emit8(e, (top == 0x3 || top == 0x5) ? 0x94 : 0x95); // sete/setne
+            emit8(e, 0xC1); // cl
+            // lea eax, [rcx*2 + next_pc], a taken skip steps over one
+            // instruction exactly like chip8_op_3XNN and friends
+            emit8(e, 0x8D); emit8(e, 0x04); emit8(e, 0x4D);
+            emit32(e, addr);
+            pc_in_rax = true;
+        }
+    }
+
+    for(uint8_t s = 0; s < CHIP8_JIT_SLOT_I; ++s)
+        if(dirty[s])
+            emit_store_u8(e, host[s], offsetof(Chip8, V) + s);
+    if(dirty[CHIP8_JIT_SLOT_I])
+        emit_store_u16(e, host[CHIP8_JIT_SLOT_I], offsetof(Chip8, I));
+    if(pc_in_rax)
+        emit_store_u16(e, RAX, offsetof(Chip8, PC));
+    else
+        emit_store_imm16(e, offsetof(Chip8, PC), next_pc);
+
+    for(int i = used - 1; i >= 0; --i)
+        if(is_callee_saved(jit_register_pool[i]))
+            emit_pop(e, jit_register_pool[i]);
+    emit8(e, 0xC3); // ret
+
+    if(e->overflow)
+        return false;
+
+    Jit_Block* b = &jit->blocks[start >> 1];
+    b->length = length;
+    b->kind = JIT_BLOCK_COMPILED;
+    for(uint16_t a = start; a < addr; ++a)
+        jit->covered[a] = true;
+    return true;
+}
+
+// The code buffer is never writable and executable at once, hardened kernels
+// and SELinux execmem policies refuse such mappings. It stays read/execute
+// and is only made writable while a block is emitted.
+static bool chip8_jit_protect(Chip8_Jit* jit, bool writable)
+{
+    return mprotect(jit->code, CHIP8_JIT_CODE_CAPACITY,
+            writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+static void chip8_jit_compile(Chip8* c, uint16_t start)
+{
+    Chip8_Jit* jit = c->jit;
+    bool compiled = false;
+    if(chip8_jit_protect(jit, true)) {
+        for(int attempt = 0; attempt < 2 && !compiled; ++attempt) {
+            uint8_t* entry = jit->code + jit->code_used;
+            Emitter e = { .p = entry, .end = jit->code + CHIP8_JIT_CODE_CAPACITY };
+            if(chip8_jit_emit_block(c, jit, start, &e)) {
+                jit->blocks[start >> 1].entry = (Jit_Block_Fn)(void*)entry;
+                jit->code_used = e.p - jit->code;
+                compiled = true;
+            } else if(e.overflow) {
+                // Out of code space, start over with an empty cache
+                chip8_jit_flush(jit);
+            } else {
+                break;
+            }
+        }
+        if(!chip8_jit_protect(jit, false)) {
+            // Nothing in the buffer can run anymore
+            chip8_jit_flush(jit);
+            compiled = false;
+        }
+    }
+    if(!compiled)
+        jit->blocks[start >> 1].kind = JIT_BLOCK_INTERPRET;
+}
+
+bool chip8_jit_init(Chip8* c)
+{
+    Chip8_Jit* jit = chip8_calloc(1, sizeof(Chip8_Jit));
+    if(jit == NULL)
+        return false;
+
+    jit->code = mmap(NULL, CHIP8_JIT_CODE_CAPACITY, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED) {
+        chip8_free(jit);
+        return false;
+    }
+    // A policy that never lets the buffer become executable leaves the JIT
+    // nothing to do, better to tell now
+    if(!chip8_jit_protect(jit, false)) {
+        munmap(jit->code, CHIP8_JIT_CODE_CAPACITY);
+        chip8_free(jit);
+        return false;
+    }
+    c->jit = jit;
+    return true;
+}
+
+void chip8_jit_deinit(Chip8* c)
+{
+    if(c->jit == NULL)
+        return;
+    munmap(c->jit->code, CHIP8_JIT_CODE_CAPACITY);
+    chip8_free(c->jit);
+    c->jit = NULL;
+}
+
+void chip8_jit_invalidate(Chip8* c, uint16_t addr)
+{
+    Chip8_Jit* jit = c->jit;
+    // Blocks are not tracked individually, a write into translated code
+    // throws the whole cache away. Self-modifying ROMs are rare enough.
+    if(jit->covered[addr])
+        chip8_jit_flush(jit);
+    jit->blocks[addr >> 1].kind = JIT_BLOCK_UNKNOWN;
+}
+
+uint64_t chip8_run_jit(Chip8* c, uint64_t count)
+{
+    Chip8_Jit* jit = c->jit;
+    uint64_t executed = 0;
+
+    // FX0A is always interpreted, a block never runs into one
+    while(executed < count && !c->waiting) {
+        uint16_t pc = c->PC;
+        if((pc & 1) || pc + 1 >= CHIP8_RAM_CAPACITY) {
+            chip8_emulate_instruction(c);
+            executed++;
+            continue;
+        }
+
+        Jit_Block* b = &jit->blocks[pc >> 1];
+        if(b->kind == JIT_BLOCK_UNKNOWN)
+            chip8_jit_compile(c, pc);
+
+        // A block never overshoots the budget, the tail of it is
+        // interpreted instead so instruction counts stay exact
+        if(b->kind == JIT_BLOCK_INTERPRET || b->length > count - executed) {
+            chip8_emulate_instruction(c);
+            executed++;
+            continue;
+        }
+
+        b->entry(c);
+        executed += b->length;
+    }
+    return executed;
+}
+
+#else // CHIP8_JIT_SUPPORTED
+
+bool chip8_jit_init(Chip8* c)
+{
+    c->jit = NULL;
+    return false;
+}
+
+void chip8_jit_deinit(Chip8* c)
+{
+    (void)c;
+}
+
+void chip8_jit_invalidate(Chip8* c, uint16_t addr)
+{
+    (void)c;
+    (void)addr;
+}
+
+uint64_t chip8_run_jit(Chip8* c, uint64_t count)
+{
+    return chip8_run_switch(c, count);
+}
+
+#endif // CHIP8_JIT_SUPPORTED
+
+#endif // CHIP8_JIT
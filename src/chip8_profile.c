@@ -0,0 +1,187 @@
+// Execution profile: how often every opcode and every address ran, and how
+// long the frames took on the host.
+//
+// Only built with -DCHIP8_PROFILE (PROFILE=1 ./build.sh). Counting happens in
+// chip8_emulate_instruction, so a profiling build always runs the switch
+// interpreter, the threaded, JIT and AOT runners never pass through it.
+// Counts per opcode class are not kept while running, the report sums the
+// counts of the exact opcodes that decode to each handler.
+#include "chip8.h"
+
+#ifdef CHIP8_PROFILE
+
+#include <string.h>
+#include <time.h>
+
+#define X(name) #name,
+static const char* const chip8_op_names[] = { CHIP8_OPS(X) };
+#undef X
+
+#define X(name) chip8_op_##name,
+static const Chip8_Handler chip8_op_handlers[] = { CHIP8_OPS(X) };
+#undef X
+
+#define CHIP8_OP_CLASSES (sizeof(chip8_op_handlers) / sizeof(chip8_op_handlers[0]))
+
+Chip8_Profile* chip8_profile_create(void)
+{
+    Chip8_Profile* p = chip8_malloc(sizeof(*p));
+    if(p != NULL) {
+        chip8_profile_reset(p);
+    }
+    return p;
+}
+
+void chip8_profile_destroy(Chip8_Profile* p)
+{
+    chip8_free(p);
+}
+
+void chip8_profile_reset(Chip8_Profile* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->frame_min_ns = UINT64_MAX;
+}
+
+uint64_t chip8_profile_now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void chip8_profile_frame(Chip8_Profile* p, uint64_t instructions, uint64_t ns)
+{
+    p->frames++;
+    p->frame_instructions += instructions;
+    p->frame_ns += ns;
+    if(ns < p->frame_min_ns) p->frame_min_ns = ns;
+    if(ns > p->frame_max_ns) p->frame_max_ns = ns;
+}
+
+static const char* chip8_profile_class_name(uint16_t opcode, size_t* index)
+{
+    const Chip8_Handler handler = chip8_decode_handler(chip8_decode(opcode));
+    for(size_t i = 0; i < CHIP8_OP_CLASSES; i++) {
+        if(chip8_op_handlers[i] == handler) {
+            if(index != NULL) *index = i;
+            return chip8_op_names[i];
+        }
+    }
+    if(index != NULL) *index = 0;
+    return chip8_op_names[0];
+}
+
+// The lowest opcode of class index
+static uint16_t chip8_profile_opcode(size_t index)
+{
+    for(uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+        if(chip8_decode_handler(chip8_decode((uint16_t)opcode)) == chip8_op_handlers[index]) {
+            return (uint16_t)opcode;
+        }
+    }
+    return 0;
+}
+
+// Fills order with the indices of the top non zero counts, largest first,
+// returns how many non zero counts there are in total
+static size_t chip8_profile_top(const uint64_t* counts, size_t n, uint32_t* order, size_t top)
+{
+    size_t found = 0, distinct = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(counts[i] == 0) continue;
+        distinct++;
+        // Insertion into the short sorted list, n is at most 64K
+        size_t at = found < top ? found++ : top;
+        while(at > 0 && counts[order[at-1]] < counts[i]) {
+            if(at < top) order[at] = order[at-1];
+            at--;
+        }
+        if(at < top) order[at] = (uint32_t)i;
+    }
+    return distinct;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total > 0 ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+void chip8_profile_report(const Chip8* c, size_t top)
+{
+    const Chip8_Profile* p = c->profile;
+    if(p == NULL) {
+        return;
+    }
+    if(top > CHIP8_PROFILE_MAX_TOP) top = CHIP8_PROFILE_MAX_TOP;
+
+    uint64_t total = 0;
+    uint64_t by_class[CHIP8_OP_CLASSES] = {0};
+    for(uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+        if(p->by_opcode[opcode] == 0) continue;
+        size_t index;
+        chip8_profile_class_name((uint16_t)opcode, &index);
+        by_class[index] += p->by_opcode[opcode];
+        total += p->by_opcode[opcode];
+    }
+
+    chip8_log(c, CHIP8_LOG_INFO, "Profile: %llu instructions\n", (unsigned long long)total);
+    if(p->frames > 0) {
+        chip8_log(c, CHIP8_LOG_INFO, "  %llu frames, %.1f instructions and %.2f us per frame "
+                "(min %.2f us, max %.2f us)\n", (unsigned long long)p->frames,
+                (double)p->frame_instructions / (double)p->frames,
+                (double)p->frame_ns / (double)p->frames / 1e3,
+                (double)p->frame_min_ns / 1e3, (double)p->frame_max_ns / 1e3);
+    }
+
+    uint32_t order[CHIP8_PROFILE_MAX_TOP];
+    size_t n = chip8_profile_top(by_class, CHIP8_OP_CLASSES, order, top);
+    chip8_log(c, CHIP8_LOG_INFO, "  by class:\n");
+    for(size_t i = 0; i < n && i < top; i++) {
+        chip8_log(c, CHIP8_LOG_INFO, "    %-6s %14llu %6.2f%%\n", chip8_op_names[order[i]],
+                (unsigned long long)by_class[order[i]], percent(by_class[order[i]], total));
+    }
+
+    n = chip8_profile_top(p->by_opcode, 0x10000, order, top);
+    chip8_log(c, CHIP8_LOG_INFO, "  by opcode (%zu distinct):\n", n);
+    for(size_t i = 0; i < n && i < top; i++) {
+        chip8_log(c, CHIP8_LOG_INFO, "    %04X   %14llu %6.2f%%  %s\n", order[i],
+                (unsigned long long)p->by_opcode[order[i]], percent(p->by_opcode[order[i]], total),
+                chip8_profile_class_name((uint16_t)order[i], NULL));
+    }
+
+    // A spin loop shows up as a handful of addresses taking most of the time
+    n = chip8_profile_top(p->by_pc, CHIP8_RAM_CAPACITY, order, top);
+    chip8_log(c, CHIP8_LOG_INFO, "  by PC (%zu distinct):\n", n);
+    for(size_t i = 0; i < n && i < top; i++) {
+        const uint16_t pc = (uint16_t)order[i];
+        const uint16_t opcode = (uint16_t)((c->ram[pc] << 8) | c->ram[(pc + 1) % CHIP8_RAM_CAPACITY]);
+        chip8_log(c, CHIP8_LOG_INFO, "    0x%03X  %14llu %6.2f%%  %04X %s\n", pc,
+                (unsigned long long)p->by_pc[pc], percent(p->by_pc[pc], total),
+                opcode, chip8_profile_class_name(opcode, NULL));
+    }
+
+    // Candidates for superinstructions: classes that often run one right
+    // after the other, summed over every address from the RAM as it is now
+    static uint64_t by_pair[CHIP8_OP_CLASSES*CHIP8_OP_CLASSES];
+    memset(by_pair, 0, sizeof(by_pair));
+    for(uint32_t pc = 0; pc + 3 < CHIP8_RAM_CAPACITY; pc++) {
+        if(p->by_fallthrough[pc] == 0) continue;
+        size_t first, second;
+        chip8_profile_class_name((uint16_t)((c->ram[pc] << 8) | c->ram[pc+1]), &first);
+        chip8_profile_class_name((uint16_t)((c->ram[pc+2] << 8) | c->ram[pc+3]), &second);
+        by_pair[first*CHIP8_OP_CLASSES + second] += p->by_fallthrough[pc];
+    }
+    n = chip8_profile_top(by_pair, CHIP8_OP_CLASSES*CHIP8_OP_CLASSES, order, top);
+    chip8_log(c, CHIP8_LOG_INFO, "  by fall-through pair (%zu distinct):\n", n);
+    for(size_t i = 0; i < n && i < top; i++) {
+        const size_t first = order[i] / CHIP8_OP_CLASSES, second = order[i] % CHIP8_OP_CLASSES;
+        const bool fused = chip8_fuse(chip8_decode(chip8_profile_opcode(first)),
+                chip8_decode(chip8_profile_opcode(second))) != NULL;
+        chip8_log(c, CHIP8_LOG_INFO, "    %-6s %-6s %14llu %6.2f%%%s\n", chip8_op_names[first],
+                chip8_op_names[second], (unsigned long long)by_pair[order[i]],
+                percent(by_pair[order[i]], total), fused ? "  fused" : "");
+    }
+}
+
+#endif // CHIP8_PROFILE
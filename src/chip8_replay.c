@@ -0,0 +1,251 @@
+// Input recording and playback.
+//
+// Apart from the ROM, the only things that make two runs differ are the keypad
+// and CXNN. CXNN draws from the generator of the instance (see chip8_seed) and
+// the keypad only changes between frames, so a run is fully described by the
+// seed, the instructions per frame and the keypad at the start of every frame.
+// Only changes of the keypad are kept, each stamped with c->cycles of the
+// frame it first showed up in.
+//
+// File format, little-endian:
+//
+//     offset  size  field
+//          0     4  magic "C8RP"
+//          4     2  version, CHIP8_REPLAY_VERSION
+//          6     2  reserved, 0
+//          8     4  seed
+//         12     4  instructions per frame
+//         16     8  cycles, length of the run
+//         24     8  chip8_replay_hash at the end of the run
+//         32     4  ROM size
+//         36     4  event count
+//         40     *  ROM
+//          *  10*n  events, u64 cycle then u16 keys
+#include "chip8.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define CHIP8_REPLAY_MAGIC "C8RP"
+#define CHIP8_REPLAY_VERSION 1
+#define CHIP8_REPLAY_HEADER_SIZE 40
+#define CHIP8_REPLAY_EVENT_SIZE 10
+
+static void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    for(int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static void put64(uint8_t* p, uint64_t v)
+{
+    for(int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static uint16_t keypad_bits(const Chip8* c)
+{
+    uint16_t keys = 0;
+    for(int i = 0; i < 16; i++) {
+        keys |= (uint16_t)c->keypad[i] << i;
+    }
+    return keys;
+}
+
+static bool replay_start(Chip8* c, Chip8_Replay* r)
+{
+    if(!chip8_load_rom(c, r->rom, r->rom_size)) {
+        return false;
+    }
+    chip8_seed(c, r->seed);
+    c->cycles = 0;
+    c->replay = r;
+    r->next = 0;
+    return true;
+}
+
+bool chip8_replay_record(Chip8* c, Chip8_Replay* r, const uint8_t* rom, size_t size,
+        uint32_t seed, uint32_t instructions_per_frame)
+{
+    memset(r, 0, sizeof(*r));
+    r->rom = chip8_malloc(size > 0 ? size : 1);
+    if(r->rom == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Out of memory for the replay\n");
+        return false;
+    }
+    memcpy(r->rom, rom, size);
+    r->rom_size = size;
+    r->seed = seed != 0 ? seed : CHIP8_DEFAULT_SEED;
+    r->instructions_per_frame = instructions_per_frame;
+    return replay_start(c, r);
+}
+
+bool chip8_replay_play(Chip8* c, Chip8_Replay* r)
+{
+    r->playing = true;
+    return replay_start(c, r);
+}
+
+void chip8_replay_finish(Chip8* c, Chip8_Replay* r)
+{
+    r->cycles = c->cycles;
+    r->state_hash = chip8_replay_hash(c);
+    c->replay = NULL;
+}
+
+void chip8_replay_input(Chip8* c)
+{
+    Chip8_Replay* r = c->replay;
+    if(r->playing) {
+        // A rewind or a loaded state can move backwards as well
+        while(r->next > 0 && r->events[r->next-1].cycle > c->cycles) r->next--;
+        while(r->next < r->count && r->events[r->next].cycle <= c->cycles) r->next++;
+        const uint16_t keys = r->next > 0 ? r->events[r->next-1].keys : 0;
+        for(int i = 0; i < 16; i++) {
+            c->keypad[i] = (keys >> i) & 1;
+        }
+        return;
+    }
+
+    // After a rewind whatever was recorded past this point never happened
+    while(r->count > 0 && r->events[r->count-1].cycle >= c->cycles) r->count--;
+
+    const uint16_t keys = keypad_bits(c);
+    const uint16_t last = r->count > 0 ? r->events[r->count-1].keys : 0;
+    if(keys == last) {
+        return;
+    }
+    if(r->count == r->capacity) {
+        size_t capacity = r->capacity ? r->capacity * 2 : 256;
+        Chip8_Replay_Event* events = chip8_realloc(r->events, capacity * sizeof(*events));
+        if(events == NULL) {
+            chip8_log(c, CHIP8_LOG_ERROR, "Out of memory for the replay, recording stopped\n");
+            c->replay = NULL;
+            return;
+        }
+        r->events = events;
+        r->capacity = capacity;
+    }
+    r->events[r->count++] = (Chip8_Replay_Event){ .cycle = c->cycles, .keys = keys };
+}
+
+void chip8_replay_free(Chip8_Replay* r)
+{
+    chip8_free(r->rom);
+    chip8_free(r->events);
+    memset(r, 0, sizeof(*r));
+}
+
+uint64_t chip8_replay_hash(const Chip8* c)
+{
+    uint8_t state[CHIP8_STATE_MAX_SIZE];
+    return chip8_state_hash(state, chip8_save_state(c, state, sizeof(state)));
+}
+
+bool chip8_replay_save(const Chip8* c, const Chip8_Replay* r, const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if(f == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Could not open %s for writing\n", path);
+        return false;
+    }
+
+    uint8_t header[CHIP8_REPLAY_HEADER_SIZE] = {0};
+    memcpy(header, CHIP8_REPLAY_MAGIC, 4);
+    put16(header + 4, CHIP8_REPLAY_VERSION);
+    put32(header + 8, r->seed);
+    put32(header + 12, r->instructions_per_frame);
+    put64(header + 16, r->cycles);
+    put64(header + 24, r->state_hash);
+    put32(header + 32, (uint32_t)r->rom_size);
+    put32(header + 36, (uint32_t)r->count);
+    bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header)
+        && fwrite(r->rom, 1, r->rom_size, f) == r->rom_size;
+    for(size_t i = 0; ok && i < r->count; i++) {
+        uint8_t event[CHIP8_REPLAY_EVENT_SIZE];
+        put64(event, r->events[i].cycle);
+        put16(event + 8, r->events[i].keys);
+        ok = fwrite(event, 1, sizeof(event), f) == sizeof(event);
+    }
+    ok = fclose(f) == 0 && ok;
+    if(!ok) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Failed to write replay %s\n", path);
+    }
+    return ok;
+}
+
+bool chip8_replay_load(const Chip8* c, Chip8_Replay* r, const char* path)
+{
+    memset(r, 0, sizeof(*r));
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Replay file %s is invalid or not exist\n", path);
+        return false;
+    }
+
+    uint8_t header[CHIP8_REPLAY_HEADER_SIZE];
+    if(fread(header, 1, sizeof(header), f) != sizeof(header)
+            || memcmp(header, CHIP8_REPLAY_MAGIC, 4) != 0) {
+        chip8_log(c, CHIP8_LOG_ERROR, "%s is not a CHIP-8 replay\n", path);
+        fclose(f);
+        return false;
+    }
+    const uint16_t version = get16(header + 4);
+    if(version != CHIP8_REPLAY_VERSION) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Replay version %u is not supported, expected %u\n",
+                version, CHIP8_REPLAY_VERSION);
+        fclose(f);
+        return false;
+    }
+    r->seed = get32(header + 8);
+    r->instructions_per_frame = get32(header + 12);
+    r->cycles = get64(header + 16);
+    r->state_hash = get64(header + 24);
+    r->rom_size = get32(header + 32);
+    r->count = r->capacity = get32(header + 36);
+
+    bool ok = r->rom_size <= CHIP8_RAM_CAPACITY - CHIP8_ROM_B && r->instructions_per_frame > 0
+        && r->count <= r->cycles + 1;
+    if(ok) {
+        r->rom = chip8_malloc(r->rom_size > 0 ? r->rom_size : 1);
+        r->events = chip8_malloc((r->count > 0 ? r->count : 1) * sizeof(*r->events));
+        ok = r->rom != NULL && r->events != NULL
+            && fread(r->rom, 1, r->rom_size, f) == r->rom_size;
+    }
+    for(size_t i = 0; ok && i < r->count; i++) {
+        uint8_t event[CHIP8_REPLAY_EVENT_SIZE];
+        if(fread(event, 1, sizeof(event), f) != sizeof(event)) {
+            ok = false;
+            break;
+        }
+        r->events[i].cycle = get64(event);
+        r->events[i].keys = get16(event + 8);
+        // Playback walks the events in order
+        ok = (i == 0 || r->events[i].cycle > r->events[i-1].cycle);
+    }
+    fclose(f);
+    if(!ok) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Replay %s is corrupted\n", path);
+        chip8_replay_free(r);
+    }
+    return ok;
+}
@@ -0,0 +1,249 @@
+// Rewind history, one save state per frame in a fixed size byte ring.
+//
+// Only the newest state is kept whole. Every older frame is stored as the XOR
+// of itself with the frame after it, run length encoded, so most of a delta
+// is a handful of zero runs: a frame typically changes a few RAM bytes, the
+// registers and some display rows. Stepping back applies the newest delta to
+// the whole state, which yields the frame before, and drops that delta.
+// Because deltas chain backwards from the newest state the oldest one can be
+// evicted at any time, no keyframe has to be kept around for it.
+//
+// Delta encoding, repeated until the state size is covered:
+//
+//     varint zero_run, varint literal_length, literal_length bytes
+//
+// Each entry in the ring is framed as
+//
+//     u32 length, u16 state_size, delta..., u32 length
+//
+// with the length at both ends so the ring can be walked from its head
+// (stepping back) and from its tail (evicting).
+#include "chip8.h"
+
+#include <string.h>
+
+// The two length fields around every entry
+#define REWIND_FRAME_OVERHEAD 8
+// Worst case of one entry: the state size and a delta that is all literals
+#define REWIND_MAX_ENTRY (2 + CHIP8_STATE_MAX_SIZE + 16)
+
+struct Chip8_Rewind {
+    uint8_t* ring;
+    size_t capacity;
+    size_t head, tail, used; // entries live in [tail, head) modulo capacity
+    size_t frames;
+    bool has_current;
+    size_t current_size;
+    uint8_t current[CHIP8_STATE_MAX_SIZE]; // the newest state, uncompressed
+    uint8_t next[CHIP8_STATE_MAX_SIZE];
+    uint8_t scratch[REWIND_MAX_ENTRY + REWIND_FRAME_OVERHEAD];
+};
+
+static void ring_write(Chip8_Rewind* r, size_t at, const uint8_t* data, size_t size)
+{
+    at %= r->capacity;
+    size_t first = r->capacity - at < size ? r->capacity - at : size;
+    memcpy(r->ring + at, data, first);
+    memcpy(r->ring, data + first, size - first);
+}
+
+static void ring_read(const Chip8_Rewind* r, size_t at, uint8_t* data, size_t size)
+{
+    at %= r->capacity;
+    size_t first = r->capacity - at < size ? r->capacity - at : size;
+    memcpy(data, r->ring + at, first);
+    memcpy(data + first, r->ring, size - first);
+}
+
+static uint32_t ring_read32(const Chip8_Rewind* r, size_t at)
+{
+    uint8_t b[4];
+    ring_read(r, at, b, 4);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    for(int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static uint8_t* put_varint(uint8_t* p, size_t v)
+{
+    while(v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, size_t* v)
+{
+    *v = 0;
+    for(int shift = 0; p < end && shift < 32; shift += 7) {
+        const uint8_t b = *p++;
+        *v |= (size_t)(b & 0x7F) << shift;
+        if((b & 0x80) == 0) return p;
+    }
+    return NULL;
+}
+
+// Encodes a ^ b, both size bytes long, returns the encoded length
+static size_t delta_encode(const uint8_t* a, const uint8_t* b, size_t size, uint8_t* out)
+{
+    uint8_t* p = out;
+    size_t i = 0;
+    while(i < size) {
+        // Equal bytes XOR to zero, skip them 8 at a time where possible
+        const size_t zero_start = i;
+        while(i + 8 <= size && memcmp(a + i, b + i, 8) == 0) i += 8;
+        while(i < size && a[i] == b[i]) i++;
+        const size_t literal_start = i;
+        // A literal run ends at the first pair of equal bytes, a single one is
+        // cheaper to carry along than a new varint pair
+        while(i < size && (a[i] != b[i] || (i + 1 < size && a[i+1] != b[i+1]))) i++;
+
+        p = put_varint(p, literal_start - zero_start);
+        p = put_varint(p, i - literal_start);
+        for(size_t k = literal_start; k < i; k++) {
+            *p++ = a[k] ^ b[k];
+        }
+    }
+    return (size_t)(p - out);
+}
+
+// XORs an encoded delta into state
+static bool delta_apply(uint8_t* state, size_t size, const uint8_t* delta, size_t delta_size)
+{
+    const uint8_t* p = delta;
+    const uint8_t* end = delta + delta_size;
+    size_t i = 0;
+    while(p < end) {
+        size_t zeros, literals;
+        p = get_varint(p, end, &zeros);
+        if(p == NULL) return false;
+        p = get_varint(p, end, &literals);
+        if(p == NULL || i + zeros + literals > size || (size_t)(end - p) < literals) return false;
+        i += zeros;
+        for(size_t k = 0; k < literals; k++) {
+            state[i++] ^= *p++;
+        }
+    }
+    return i == size;
+}
+
+Chip8_Rewind* chip8_rewind_create(size_t budget)
+{
+    // The newest state and the scratch buffers count against the budget too
+    if(budget < sizeof(Chip8_Rewind) + REWIND_MAX_ENTRY + REWIND_FRAME_OVERHEAD) {
+        return NULL;
+    }
+    Chip8_Rewind* r = chip8_calloc(1, sizeof(*r));
+    if(r == NULL) {
+        return NULL;
+    }
+    r->capacity = budget - sizeof(Chip8_Rewind);
+    r->ring = chip8_malloc(r->capacity);
+    if(r->ring == NULL) {
+        chip8_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void chip8_rewind_destroy(Chip8_Rewind* r)
+{
+    if(r == NULL) {
+        return;
+    }
+    chip8_free(r->ring);
+    chip8_free(r);
+}
+
+void chip8_rewind_clear(Chip8_Rewind* r)
+{
+    r->head = r->tail = r->used = 0;
+    r->frames = 0;
+    r->has_current = false;
+}
+
+size_t chip8_rewind_frames(const Chip8_Rewind* r)
+{
+    return r->has_current ? r->frames + 1 : 0;
+}
+
+size_t chip8_rewind_used(const Chip8_Rewind* r)
+{
+    return r->used;
+}
+
+static void chip8_rewind_evict(Chip8_Rewind* r)
+{
+    const size_t length = ring_read32(r, r->tail);
+    r->tail = (r->tail + length + REWIND_FRAME_OVERHEAD) % r->capacity;
+    r->used -= length + REWIND_FRAME_OVERHEAD;
+    r->frames--;
+}
+
+void chip8_rewind_push(Chip8_Rewind* r, const Chip8* c)
+{
+    const size_t size = chip8_save_state(c, r->next, sizeof(r->next));
+    if(!r->has_current) {
+        memcpy(r->current, r->next, size);
+        r->current_size = size;
+        r->has_current = true;
+        return;
+    }
+
+    // A resolution switch changes the state size, the shorter one is padded
+    // with zeros so both XOR over the same length
+    const size_t span = size > r->current_size ? size : r->current_size;
+    memset(r->next + size, 0, span - size);
+    memset(r->current + r->current_size, 0, span - r->current_size);
+
+    uint8_t* entry = r->scratch;
+    const size_t length = 2 + delta_encode(r->current, r->next, span, entry + 6);
+    put32(entry, (uint32_t)length);
+    entry[4] = (uint8_t)r->current_size;
+    entry[5] = (uint8_t)(r->current_size >> 8);
+    put32(entry + 4 + length, (uint32_t)length);
+
+    while(r->used + length + REWIND_FRAME_OVERHEAD > r->capacity) {
+        chip8_rewind_evict(r);
+    }
+    ring_write(r, r->head, entry, length + REWIND_FRAME_OVERHEAD);
+    r->head = (r->head + length + REWIND_FRAME_OVERHEAD) % r->capacity;
+    r->used += length + REWIND_FRAME_OVERHEAD;
+    r->frames++;
+
+    memcpy(r->current, r->next, size);
+    r->current_size = size;
+}
+
+bool chip8_rewind_pop(Chip8_Rewind* r, Chip8* c)
+{
+    if(!r->has_current || r->frames == 0) {
+        return false;
+    }
+
+    const size_t trailer = (r->head + r->capacity - 4) % r->capacity;
+    const size_t length = ring_read32(r, trailer);
+    const size_t start = (trailer + r->capacity - length) % r->capacity;
+    uint8_t* entry = r->scratch;
+    ring_read(r, start, entry, length);
+
+    const size_t previous_size = entry[0] | (entry[1] << 8);
+    const size_t span = previous_size > r->current_size ? previous_size : r->current_size;
+    memset(r->current + r->current_size, 0, span - r->current_size);
+    if(!delta_apply(r->current, span, entry + 2, length - 2)) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Rewind history is corrupted, dropping it\n");
+        chip8_rewind_clear(r);
+        return false;
+    }
+    r->current_size = previous_size;
+    r->head = (start + r->capacity - 4) % r->capacity;
+    r->used -= length + REWIND_FRAME_OVERHEAD;
+    r->frames--;
+
+    return chip8_load_state(c, r->current, r->current_size);
+}
@@ -0,0 +1,475 @@
+// Lockstep structure-of-arrays engine: many instances of one ROM stepped side
+// by side.
+//
+// The registers every opcode touches (V0-VF, I, PC and the timers) are kept
+// as one array per register with one entry per lane, so the same register of
+// 32 lanes fills one AVX2 vector. Everything else (RAM, display, stack,
+// keypad) stays in a full Chip8 per lane.
+//
+// chip8_step_batch runs in rounds, every lane retires exactly one instruction
+// per round. A round picks the lowest PC among the lanes still pending, masks
+// in every pending lane sitting at that PC and executes the opcode once for
+// all of them, then repeats until no lane is pending. Lanes that agree on PC,
+// the usual case when the instances only differ in their input, cost one
+// group per round. Lanes that branched apart are run in separate groups and
+// merge again as soon as their PCs meet, lowest PC first keeps the ones
+// that fell behind catching up, the way a GPU warp re-converges.
+//
+// Register only opcodes are executed with vector blends under the lane mask.
+// Everything else goes lane by lane through the interpreter's own handlers
+// on the lane's Chip8, so semantics can not drift.
+#include "chip8.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define SOA_LANE_ALIGN 32 // lanes are padded so byte arrays fill whole vectors
+// How far a taken skip moves PC past the next instruction, must match
+// chip8_op_3XNN and friends
+#define SOA_SKIP_SIZE 2
+
+struct Chip8_Soa {
+    uint32_t lanes, padded;
+    uint8_t* V[16]; // V[x][lane]
+    uint16_t* I;
+    uint16_t* PC;
+    uint8_t* delay_timer;
+    uint8_t* sound_timer;
+    uint8_t* live; // 0xFF for real lanes, 0 for the padding
+    uint8_t* pending; // lanes that still have to run this round
+    uint8_t* mask; // lanes executing the current group
+    uint8_t* cond; // scratch, per lane result of a skip test
+    Chip8* state; // the rest of every lane, its registers are stale
+    uint8_t code[CHIP8_RAM_CAPACITY]; // RAM of the prototype
+    uint64_t written[CHIP8_RAM_CAPACITY/64]; // bytes that may differ from code in some lane
+};
+
+typedef enum {
+    SOA_SET_NN = 0,
+    SOA_ADD_NN,
+    SOA_MOV,
+    SOA_OR,
+    SOA_AND,
+    SOA_XOR,
+    SOA_EQ_NN, // the comparisons write 0xFF/0 into the destination
+    SOA_NE_NN,
+    SOA_EQ,
+    SOA_NE,
+} Soa_Op8;
+
+typedef enum {
+    SOA_SET16 = 0,
+    SOA_ADD16, // dst += value
+    SOA_ADD16_SRC, // dst += src[lane]
+    SOA_ADD16_COND, // dst += value where src[lane] is non zero
+} Soa_Op16;
+
+static uint8_t soa_op8_scalar(Soa_Op8 op, uint8_t a, uint8_t b, uint8_t nn)
+{
+    switch(op) {
+        case SOA_SET_NN: return nn;
+        case SOA_ADD_NN: return a + nn;
+        case SOA_MOV: return b;
+        case SOA_OR: return a | b;
+        case SOA_AND: return a & b;
+        case SOA_XOR: return a ^ b;
+        case SOA_EQ_NN: return a == nn ? 0xFF : 0;
+        case SOA_NE_NN: return a != nn ? 0xFF : 0;
+        case SOA_EQ: return a == b ? 0xFF : 0;
+        case SOA_NE: return a != b ? 0xFF : 0;
+    }
+    return a;
+}
+
+// dst[lane] = op(a[lane], b[lane], nn) for every lane in the group
+static void soa_op8(const Chip8_Soa* s, Soa_Op8 op, uint8_t* dst, const uint8_t* a,
+        const uint8_t* b, uint8_t nn)
+{
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    const __m256i vnn = _mm256_set1_epi8((char)nn);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    for(; i < s->padded; i += 32) {
+        const __m256i m = _mm256_loadu_si256((const __m256i*)&s->mask[i]);
+        if(_mm256_testz_si256(m, m)) continue;
+        const __m256i va = _mm256_loadu_si256((const __m256i*)&a[i]);
+        const __m256i vb = _mm256_loadu_si256((const __m256i*)&b[i]);
+        __m256i r;
+        switch(op) {
+            case SOA_SET_NN: r = vnn; break;
+            case SOA_ADD_NN: r = _mm256_add_epi8(va, vnn); break;
+            case SOA_MOV: r = vb; break;
+            case SOA_OR: r = _mm256_or_si256(va, vb); break;
+            case SOA_AND: r = _mm256_and_si256(va, vb); break;
+            case SOA_XOR: r = _mm256_xor_si256(va, vb); break;
+            case SOA_EQ_NN: r = _mm256_cmpeq_epi8(va, vnn); break;
+            case SOA_NE_NN: r = _mm256_xor_si256(_mm256_cmpeq_epi8(va, vnn), ones); break;
+            case SOA_EQ: r = _mm256_cmpeq_epi8(va, vb); break;
+            case SOA_NE: r = _mm256_xor_si256(_mm256_cmpeq_epi8(va, vb), ones); break;
+            default: r = va; break;
+        }
+        const __m256i old = _mm256_loadu_si256((const __m256i*)&dst[i]);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_blendv_epi8(old, r, m));
+    }
+#endif
+    for(; i < s->lanes; i++) {
+        if(s->mask[i]) dst[i] = soa_op8_scalar(op, a[i], b[i], nn);
+    }
+}
+
+// The same for the 16 bit registers, src is a per lane byte operand
+static void soa_op16(const Chip8_Soa* s, Soa_Op16 op, uint16_t* dst, const uint8_t* src,
+        uint16_t value)
+{
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    const __m256i vvalue = _mm256_set1_epi16((short)value);
+    for(; i < s->padded; i += 16) {
+        const __m128i m8 = _mm_loadu_si128((const __m128i*)&s->mask[i]);
+        if(_mm_testz_si128(m8, m8)) continue;
+        const __m256i m = _mm256_cvtepi8_epi16(m8);
+        const __m256i old = _mm256_loadu_si256((const __m256i*)&dst[i]);
+        __m256i r;
+        switch(op) {
+            case SOA_SET16: r = vvalue; break;
+            case SOA_ADD16: r = _mm256_add_epi16(old, vvalue); break;
+            case SOA_ADD16_SRC:
+                r = _mm256_add_epi16(old, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&src[i])));
+                break;
+            case SOA_ADD16_COND: {
+                const __m256i c = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)&src[i]));
+                r = _mm256_add_epi16(old, _mm256_and_si256(vvalue, c));
+            } break;
+            default: r = old; break;
+        }
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_blendv_epi8(old, r, m));
+    }
+#endif
+    for(; i < s->lanes; i++) {
+        if(!s->mask[i]) continue;
+        switch(op) {
+            case SOA_SET16: dst[i] = value; break;
+            case SOA_ADD16: dst[i] += value; break;
+            case SOA_ADD16_SRC: dst[i] += src[i]; break;
+            case SOA_ADD16_COND: if(src[i]) dst[i] += value; break;
+        }
+    }
+}
+
+// Picks the lowest PC among the pending lanes and moves every pending lane
+// at that PC into the group mask. Returns false when no lane is pending.
+static bool soa_next_group(Chip8_Soa* s, uint16_t* pc)
+{
+    uint32_t i = 0;
+    uint16_t leader = 0xFFFF;
+    bool any = false;
+
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi16(-1);
+    __m256i best = ones;
+    __m256i seen = _mm256_setzero_si256();
+    for(; i < s->padded; i += 16) {
+        const __m256i p = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)&s->pending[i]));
+        const __m256i v = _mm256_loadu_si256((const __m256i*)&s->PC[i]);
+        best = _mm256_min_epu16(best, _mm256_or_si256(v, _mm256_andnot_si256(p, ones)));
+        seen = _mm256_or_si256(seen, p);
+    }
+    any = !_mm256_testz_si256(seen, seen);
+    if(!any) return false;
+    const __m128i half = _mm_min_epu16(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    leader = (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(half));
+
+    const __m256i vleader = _mm256_set1_epi16((short)leader);
+    for(i = 0; i < s->padded; i += 16) {
+        const __m128i p8 = _mm_loadu_si128((const __m128i*)&s->pending[i]);
+        const __m256i v = _mm256_loadu_si256((const __m256i*)&s->PC[i]);
+        const __m256i eq = _mm256_cmpeq_epi16(v, vleader);
+        const __m128i eq8 = _mm_and_si128(p8, _mm_packs_epi16(_mm256_castsi256_si128(eq),
+                    _mm256_extracti128_si256(eq, 1)));
+        _mm_storeu_si128((__m128i*)&s->mask[i], eq8);
+        _mm_storeu_si128((__m128i*)&s->pending[i], _mm_andnot_si128(eq8, p8));
+    }
+#else
+    for(; i < s->lanes; i++) {
+        if(s->pending[i] && (!any || s->PC[i] < leader)) {
+            leader = s->PC[i];
+            any = true;
+        }
+    }
+    if(!any) return false;
+    for(i = 0; i < s->lanes; i++) {
+        s->mask[i] = (s->pending[i] && s->PC[i] == leader) ? 0xFF : 0;
+        s->pending[i] &= ~s->mask[i];
+    }
+#endif
+
+    *pc = leader;
+    return true;
+}
+
+static uint16_t soa_lane_opcode(const Chip8_Soa* s, uint32_t lane, uint16_t pc)
+{
+    const uint8_t* ram = s->state[lane].ram;
+    return (ram[pc % CHIP8_RAM_CAPACITY] << 8) | ram[(pc + 1) % CHIP8_RAM_CAPACITY];
+}
+
+// The opcode the group executes. Unless some lane stored to the bytes at pc
+// they still hold the prototype's code, otherwise lanes fetching something
+// else than the first one are put back to pending for a later group.
+static uint16_t soa_group_opcode(Chip8_Soa* s, uint16_t pc)
+{
+    const uint16_t a = pc % CHIP8_RAM_CAPACITY, b = (pc + 1) % CHIP8_RAM_CAPACITY;
+    if(((s->written[a / 64] >> (a % 64)) & 1) == 0 && ((s->written[b / 64] >> (b % 64)) & 1) == 0) {
+        return (s->code[a] << 8) | s->code[b];
+    }
+
+    bool first = true;
+    uint16_t opcode = 0;
+    for(uint32_t i = 0; i < s->lanes; i++) {
+        if(!s->mask[i]) continue;
+        const uint16_t lane_opcode = soa_lane_opcode(s, i, pc);
+        if(first) {
+            opcode = lane_opcode;
+            first = false;
+        } else if(lane_opcode != opcode) {
+            s->mask[i] = 0;
+            s->pending[i] = 0xFF;
+        }
+    }
+    return opcode;
+}
+
+static void soa_load_lane(const Chip8_Soa* s, uint32_t lane, Chip8* c)
+{
+    for(int x = 0; x < 16; x++) c->V[x] = s->V[x][lane];
+    c->I = s->I[lane];
+    c->PC = s->PC[lane];
+    c->delay_timer = s->delay_timer[lane];
+    c->sound_timer = s->sound_timer[lane];
+}
+
+static void soa_store_lane(Chip8_Soa* s, uint32_t lane, const Chip8* c)
+{
+    for(int x = 0; x < 16; x++) s->V[x][lane] = c->V[x];
+    s->I[lane] = c->I;
+    s->PC[lane] = c->PC;
+    s->delay_timer[lane] = c->delay_timer;
+    s->sound_timer[lane] = c->sound_timer;
+}
+
+// Runs the handler on every lane of the group, one at a time
+static void soa_interpret(Chip8_Soa* s, Inst inst)
+{
+    const Chip8_Handler handler = chip8_decode_handler(inst);
+    for(uint32_t i = 0; i < s->lanes; i++) {
+        if(!s->mask[i]) continue;
+        Chip8* c = &s->state[i];
+        soa_load_lane(s, i, c);
+        handler(c, inst);
+        soa_store_lane(s, i, c);
+        // Whatever this lane stored to can no longer be fetched from code
+        for(uint32_t w = 0; w < CHIP8_RAM_CAPACITY/64; w++) {
+            s->written[w] |= c->written[w];
+        }
+    }
+}
+
+static void soa_execute(Chip8_Soa* s, uint16_t opcode)
+{
+    const Inst inst = chip8_decode(opcode);
+    uint8_t* vx = s->V[inst.X];
+    const uint8_t* vy = s->V[inst.Y];
+
+    // Like the interpreter, PC points past the instruction while it runs
+    soa_op16(s, SOA_ADD16, s->PC, NULL, 2);
+
+    switch((opcode >> 12) & 0x0F) {
+        case 0x1: soa_op16(s, SOA_SET16, s->PC, NULL, inst.NNN); return;
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x9:
+            {
+                static const Soa_Op8 tests[16] = {
+                    [0x3] = SOA_EQ_NN, [0x4] = SOA_NE_NN, [0x5] = SOA_EQ, [0x9] = SOA_NE,
+                };
+                soa_op8(s, tests[opcode >> 12], s->cond, vx, vy, inst.NN);
+                soa_op16(s, SOA_ADD16_COND, s->PC, s->cond, SOA_SKIP_SIZE);
+            } return;
+        case 0x6: soa_op8(s, SOA_SET_NN, vx, vx, vy, inst.NN); return;
+        case 0x7: soa_op8(s, SOA_ADD_NN, vx, vx, vy, inst.NN); return;
+        case 0x8:
+            {
+                switch(inst.N) {
+                    case 0x0: soa_op8(s, SOA_MOV, vx, vx, vy, 0); return;
+                    case 0x1: soa_op8(s, SOA_OR, vx, vx, vy, 0); return;
+                    case 0x2: soa_op8(s, SOA_AND, vx, vx, vy, 0); return;
+                    case 0x3: soa_op8(s, SOA_XOR, vx, vx, vy, 0); return;
+                    default: break;
+                }
+            } break;
+        case 0xA: soa_op16(s, SOA_SET16, s->I, NULL, inst.NNN); return;
+        case 0xF:
+            {
+                switch(inst.NN) {
+                    case 0x07: soa_op8(s, SOA_MOV, vx, vx, s->delay_timer, 0); return;
+                    case 0x15: soa_op8(s, SOA_MOV, s->delay_timer, s->delay_timer, vx, 0); return;
+                    case 0x18: soa_op8(s, SOA_MOV, s->sound_timer, s->sound_timer, vx, 0); return;
+                    case 0x1E: soa_op16(s, SOA_ADD16_SRC, s->I, vx, 0); return;
+                    default: break;
+                }
+            } break;
+        default:
+            break;
+    }
+
+    soa_interpret(s, inst);
+}
+
+Chip8_Soa* chip8_soa_create(const Chip8* prototype, uint32_t lanes)
+{
+    if(lanes == 0) {
+        return NULL;
+    }
+    Chip8_Soa* s = chip8_calloc(1, sizeof(*s));
+    if(s == NULL) {
+        return NULL;
+    }
+    s->lanes = lanes;
+    s->padded = (lanes + SOA_LANE_ALIGN - 1) / SOA_LANE_ALIGN * SOA_LANE_ALIGN;
+
+    // One block for all the lane arrays, each a multiple of 32 bytes long
+    const size_t bytes = s->padded * (16 + 2 + 2 + 1 + 1 + 4);
+    uint8_t* block = chip8_calloc(1, bytes);
+    s->state = chip8_malloc(sizeof(Chip8) * lanes);
+    if(block == NULL || s->state == NULL) {
+        chip8_free(block);
+        chip8_free(s->state);
+        chip8_free(s);
+        return NULL;
+    }
+    for(int x = 0; x < 16; x++) {
+        s->V[x] = block;
+        block += s->padded;
+    }
+    s->I = (uint16_t*)block;
+    block += s->padded * 2;
+    s->PC = (uint16_t*)block;
+    block += s->padded * 2;
+    s->delay_timer = block;
+    block += s->padded;
+    s->sound_timer = block;
+    block += s->padded;
+    s->live = block;
+    block += s->padded;
+    s->pending = block;
+    block += s->padded;
+    s->mask = block;
+    block += s->padded;
+    s->cond = block;
+
+    memcpy(s->code, prototype->ram, sizeof(s->code));
+    for(uint32_t i = 0; i < lanes; i++) {
+        s->live[i] = 0xFF;
+        chip8_soa_write(s, i, prototype);
+    }
+    return s;
+}
+
+void chip8_soa_destroy(Chip8_Soa* s)
+{
+    if(s == NULL) {
+        return;
+    }
+    chip8_free(s->V[0]);
+    chip8_free(s->state);
+    chip8_free(s);
+}
+
+uint32_t chip8_soa_lanes(const Chip8_Soa* s)
+{
+    return s->lanes;
+}
+
+void chip8_soa_read(const Chip8_Soa* s, uint32_t lane, Chip8* out)
+{
+    memcpy(out, &s->state[lane], sizeof(*out));
+    out->stack = (uint16_t*)(out->ram + ((const uint8_t*)s->state[lane].stack - s->state[lane].ram));
+    soa_load_lane(s, lane, out);
+}
+
+void chip8_soa_write(Chip8_Soa* s, uint32_t lane, const Chip8* in)
+{
+    Chip8* c = &s->state[lane];
+    memcpy(c, in, sizeof(*c));
+    c->stack = (uint16_t*)(c->ram + ((const uint8_t*)in->stack - in->ram));
+#ifdef CHIP8_JIT
+    c->jit = NULL; // the lane is never run through chip8_run
+#endif
+#ifdef CHIP8_AOT
+    c->aot = false;
+#endif
+#ifdef CHIP8_PROFILE
+    c->profile = NULL; // owned by the prototype
+#endif
+#ifndef NDEBUG
+    c->trace = NULL;
+#endif
+    soa_store_lane(s, lane, c);
+
+    // Code this lane does not share with the prototype must be fetched per lane
+    for(uint32_t addr = 0; addr < CHIP8_RAM_CAPACITY; addr++) {
+        if(c->ram[addr] != s->code[addr]) {
+            s->written[addr / 64] |= 1ull << (addr % 64);
+        }
+    }
+    for(uint32_t w = 0; w < CHIP8_RAM_CAPACITY/64; w++) {
+        s->written[w] |= c->written[w];
+    }
+}
+
+void chip8_soa_input(Chip8_Soa* s, uint32_t lane, const bool keypad[16])
+{
+    memcpy(s->state[lane].keypad, keypad, sizeof(s->state[lane].keypad));
+}
+
+uint64_t chip8_step_batch(Chip8_Soa* s, uint64_t steps)
+{
+    // A woken lane leaves its FX0A, one still blocked keeps spinning on it
+    for(uint32_t i = 0; i < s->lanes; i++) {
+        Chip8* c = &s->state[i];
+        if(!c->waiting) continue;
+        soa_load_lane(s, i, c);
+        chip8_wait_key(c);
+        soa_store_lane(s, i, c);
+    }
+    for(uint64_t round = 0; round < steps; round++) {
+        memcpy(s->pending, s->live, s->padded);
+        uint16_t pc;
+        while(soa_next_group(s, &pc)) {
+            soa_execute(s, soa_group_opcode(s, pc));
+        }
+    }
+    return steps * s->lanes;
+}
+
+void chip8_soa_update_timers(Chip8_Soa* s)
+{
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    const __m256i one = _mm256_set1_epi8(1);
+    for(; i < s->padded; i += 32) {
+        __m256i* d = (__m256i*)&s->delay_timer[i];
+        __m256i* t = (__m256i*)&s->sound_timer[i];
+        _mm256_storeu_si256(d, _mm256_subs_epu8(_mm256_loadu_si256(d), one));
+        _mm256_storeu_si256(t, _mm256_subs_epu8(_mm256_loadu_si256(t), one));
+    }
+#endif
+    for(; i < s->lanes; i++) {
+        if(s->delay_timer[i] > 0) s->delay_timer[i] -= 1;
+        if(s->sound_timer[i] > 0) s->sound_timer[i] -= 1;
+    }
+}
@@ -0,0 +1,207 @@
+// Save states.
+//
+// A snapshot is a flat little-endian byte string, independent of the host
+// and of how Chip8 is laid out in memory:
+//
+//     offset  size  field
+//          0     4  magic "C8ST"
+//          4     2  version, CHIP8_STATE_VERSION
+//          6     2  flags, bit 0 hires, bit 1 waiting in FX0A
+//          8    16  V0-VF
+//         24     2  I
+//         26     2  PC
+//         28     2  stack pointer as an offset into RAM
+//         30     1  delay timer
+//         31     1  sound timer
+//         32     2  keypad, bit n set while key n is down
+//         34     4  state of the CXNN generator
+//         38     8  cycles
+//         46     2  keys down at the last FX0A check, 0 unless waiting
+//         48     1  X of that FX0A, 0 unless waiting
+//         49  4096  RAM
+//       4145     *  display, the visible rows of every word column used,
+//                   column by column, each row a 64 bit word (256 bytes in
+//                   lores, 1024 in hires)
+//
+// Caches (predecode, JIT, AOT written map) are not part of a snapshot. Loading
+// one invalidates exactly the RAM bytes that change, so a load that only
+// touches data keeps all translated code.
+#include "chip8.h"
+
+#include <string.h>
+
+#define CHIP8_STATE_MAGIC "C8ST"
+
+static void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void put64(uint8_t* p, uint64_t v)
+{
+    for(int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    for(int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* p)
+{
+    uint64_t v = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&v, p, 8);
+#else
+    for(int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8*i);
+#endif
+    return v;
+}
+
+static size_t chip8_state_display_size(bool hires)
+{
+    return hires
+        ? (CHIP8_HIRES_WIDTH / 64) * CHIP8_HIRES_HEIGHT * 8
+        : CHIP8_DEFAULT_WINDOW_HEIGHT * 8;
+}
+
+size_t chip8_state_size(const Chip8* c)
+{
+    return CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY + chip8_state_display_size(c->hires);
+}
+
+size_t chip8_save_state(const Chip8* c, uint8_t* out, size_t capacity)
+{
+    const size_t size = chip8_state_size(c);
+    if(capacity < size) {
+        return 0;
+    }
+
+    uint16_t keypad = 0;
+    for(int i = 0; i < 16; i++) {
+        keypad |= (uint16_t)c->keypad[i] << i;
+    }
+
+    memcpy(out, CHIP8_STATE_MAGIC, 4);
+    put16(out + 4, CHIP8_STATE_VERSION);
+    put16(out + 6, (c->hires ? 1 : 0) | (c->waiting ? 2 : 0));
+    memcpy(out + 8, c->V, 16);
+    put16(out + 24, c->I);
+    put16(out + 26, c->PC);
+    put16(out + 28, (uint16_t)((const uint8_t*)c->stack - c->ram));
+    out[30] = c->delay_timer;
+    out[31] = c->sound_timer;
+    put16(out + 32, keypad);
+    put32(out + 34, c->rng);
+    put64(out + 38, c->cycles);
+    put16(out + 46, c->waiting ? c->wait_keys : 0);
+    out[48] = c->waiting ? c->wait_register : 0;
+    memcpy(out + CHIP8_STATE_HEADER_SIZE, c->ram, CHIP8_RAM_CAPACITY);
+
+    uint8_t* p = out + CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY;
+    for(uint32_t w = 0; w < (CHIP8_WIDTH(c) + 63) / 64; w++) {
+        for(uint32_t y = 0; y < CHIP8_HEIGHT(c); y++, p += 8) {
+            put64(p, c->display[w][y]);
+        }
+    }
+    return size;
+}
+
+bool chip8_load_state(Chip8* c, const uint8_t* in, size_t size)
+{
+    if(size < CHIP8_STATE_HEADER_SIZE || memcmp(in, CHIP8_STATE_MAGIC, 4) != 0) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Not a CHIP-8 save state\n");
+        return false;
+    }
+    const uint16_t version = get16(in + 4);
+    if(version != CHIP8_STATE_VERSION) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Save state version %u is not supported, expected %u\n",
+                version, CHIP8_STATE_VERSION);
+        return false;
+    }
+    const bool hires = (get16(in + 6) & 1) != 0;
+    const bool waiting = (get16(in + 6) & 2) != 0;
+    const uint16_t sp = get16(in + 28);
+    if(size != CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY + chip8_state_display_size(hires)
+            || sp < CHIP8_STACK_B || sp >= CHIP8_STACK_B + 2*CHIP8_STACK_DEPTH
+            || (sp - CHIP8_STACK_B) % 2 != 0 || get32(in + 34) == 0 || in[48] > 0xF) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Save state is corrupted\n");
+        return false;
+    }
+
+    // Only bytes that really change need their cached decoding dropped,
+    // compare a word at a time and look closer where one differs
+    const uint8_t* ram = in + CHIP8_STATE_HEADER_SIZE;
+    for(uint32_t base = 0; base < CHIP8_RAM_CAPACITY; base += 8) {
+        if(memcmp(&c->ram[base], &ram[base], 8) == 0) continue;
+        for(uint32_t addr = base; addr < base + 8; addr++) {
+            if(c->ram[addr] != ram[addr]) {
+                c->ram[addr] = ram[addr];
+                chip8_invalidate(c, (uint16_t)addr);
+            }
+        }
+    }
+
+    memcpy(c->V, in + 8, 16);
+    c->I = get16(in + 24);
+    c->PC = get16(in + 26);
+    c->stack = (uint16_t*)&c->ram[sp];
+    c->delay_timer = in[30];
+    c->sound_timer = in[31];
+    const uint16_t keypad = get16(in + 32);
+    for(int i = 0; i < 16; i++) {
+        c->keypad[i] = (keypad >> i) & 1;
+    }
+    c->rng = get32(in + 34);
+    c->cycles = get64(in + 38);
+    c->waiting = waiting;
+    c->wait_keys = get16(in + 46);
+    c->wait_register = in[48];
+
+    c->hires = hires;
+    memset(c->display, 0, sizeof(c->display));
+    const uint8_t* p = ram + CHIP8_RAM_CAPACITY;
+    for(uint32_t w = 0; w < (CHIP8_WIDTH(c) + 63) / 64; w++) {
+        for(uint32_t y = 0; y < CHIP8_HEIGHT(c); y++, p += 8) {
+            c->display[w][y] = get64(p);
+        }
+    }
+    c->dirty_rows = ~0ull;
+    return true;
+}
+
+uint64_t chip8_state_hash(const uint8_t* state, size_t size)
+{
+    // FNV-1a over 64 bit little-endian words in four interleaved streams, so
+    // the multiplies do not wait on each other, then the tail byte by byte.
+    // The multiply only carries upwards, folding the high half back in after
+    // every word lets all of its bits reach the whole hash.
+    uint64_t h[4] = { 0xcbf29ce484222325ull, 0x84222325cbf29ce4ull, 0xcbf29ce4ull, 0x84222325ull };
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32) {
+        for(int k = 0; k < 4; k++) {
+            h[k] = (h[k] ^ get64(state + i + 8*k)) * 0x100000001b3ull;
+            h[k] ^= h[k] >> 32;
+        }
+    }
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(int k = 0; k < 4; k++) {
+        hash = (hash ^ h[k]) * 0x100000001b3ull;
+        hash ^= hash >> 32;
+    }
+    for(; i < size; i++) {
+        hash = (hash ^ state[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
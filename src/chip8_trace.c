@@ -0,0 +1,264 @@
+// Binary instruction trace and disassembler.
+//
+// Only debug builds (no NDEBUG) trace, and only after chip8_trace_start.
+// chip8_emulate_instruction and the threaded dispatcher append one fixed
+// size record per instruction, blocks run by the JIT or an AOT translation
+// are not traced. The records go into a power of two ring per instance, so
+// the trace always holds the last capacity instructions.
+//
+// A record gets its changed register mask when the next instruction is
+// appended, by comparing the registers with a copy taken before it ran.
+// Only finished records are published, by a release store of head, so the
+// ring has a single writer and needs no lock. A reader on another thread
+// copies what it wants, then reads head again and drops every record the
+// writer may have overwritten in the meantime.
+//
+// Trace file, little-endian:
+//
+//     offset  size  field
+//          0     4  magic "C8TR"
+//          4     2  version, CHIP8_TRACE_VERSION
+//          6     2  record size, 8
+//          8     8  sequence number of the first record
+//         16     8  record count
+//         24   8*n  records: PC, opcode, I, changed mask, 16 bits each
+#include "chip8.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef NDEBUG
+
+#include <stdatomic.h>
+
+#define CHIP8_TRACE_MAGIC "C8TR"
+#define CHIP8_TRACE_VERSION 1
+#define CHIP8_TRACE_HEADER_SIZE 24
+#define CHIP8_TRACE_RECORD_SIZE 8
+
+struct Chip8_Trace {
+    Chip8_Trace_Record* records;
+    uint64_t mask; // capacity - 1
+    _Atomic uint64_t head; // records published so far
+    bool pending; // records[head & mask] is written but not finished
+    uint8_t V[16]; // registers before the pending record ran
+};
+
+bool chip8_trace_start(Chip8* c, size_t capacity)
+{
+    // Round up to a power of two so the ring index is a mask
+    size_t rounded = 2;
+    while(rounded < capacity) rounded <<= 1;
+
+    chip8_trace_stop(c);
+    Chip8_Trace* t = chip8_calloc(1, sizeof(*t));
+    if(t != NULL) {
+        t->records = chip8_malloc(rounded * sizeof(*t->records));
+    }
+    if(t == NULL || t->records == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Out of memory for a trace of %zu instructions\n", rounded);
+        chip8_free(t);
+        return false;
+    }
+    t->mask = rounded - 1;
+    atomic_init(&t->head, 0);
+    c->trace = t;
+    return true;
+}
+
+void chip8_trace_stop(Chip8* c)
+{
+    if(c->trace != NULL) {
+        chip8_free(c->trace->records);
+        chip8_free(c->trace);
+        c->trace = NULL;
+    }
+}
+
+// One bit per register that differs, eight registers at a time: fold every
+// byte of the XOR onto its lowest bit, then gather those bits with a multiply
+static uint16_t chip8_trace_changed(const uint8_t* before, const uint8_t* after)
+{
+    uint16_t changed = 0;
+    for(int half = 0; half < 2; half++) {
+        uint64_t a, b;
+        memcpy(&a, before + 8*half, 8);
+        memcpy(&b, after + 8*half, 8);
+        uint64_t x = a ^ b;
+        x |= x >> 4;
+        x |= x >> 2;
+        x |= x >> 1;
+        x &= 0x0101010101010101ull;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+        changed |= (uint16_t)(((x * 0x0102040810204080ull) >> 56) << (8*half));
+    }
+    return changed;
+}
+
+void chip8_trace_flush(Chip8* c)
+{
+    Chip8_Trace* t = c->trace;
+    if(t == NULL || !t->pending) {
+        return;
+    }
+    const uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    t->records[head & t->mask].changed = chip8_trace_changed(t->V, c->V);
+    t->pending = false;
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+void chip8_trace_append(Chip8* c, uint16_t pc, uint16_t opcode)
+{
+    Chip8_Trace* t = c->trace;
+    chip8_trace_flush(c);
+    const uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    t->records[head & t->mask] = (Chip8_Trace_Record){ .pc = pc, .opcode = opcode, .I = c->I };
+    memcpy(t->V, c->V, sizeof(t->V));
+    t->pending = true;
+}
+
+size_t chip8_trace_snapshot(const Chip8* c, Chip8_Trace_Record* out, size_t max, uint64_t* first)
+{
+    const Chip8_Trace* t = c->trace;
+    *first = 0;
+    if(t == NULL) {
+        return 0;
+    }
+
+    // The slot after the newest published record may be the one being
+    // written, so at most capacity - 1 records are safe to read
+    const uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+    uint64_t begin = head > t->mask ? head - t->mask : 0;
+    if(head - begin > max) begin = head - max;
+    for(uint64_t i = begin; i < head; i++) {
+        out[i - begin] = t->records[i & t->mask];
+    }
+
+    // Whatever the writer got to while copying is lost
+    atomic_thread_fence(memory_order_acquire);
+    const uint64_t now = atomic_load_explicit(&t->head, memory_order_relaxed);
+    uint64_t valid = now > t->mask ? now - t->mask : 0;
+    if(valid < begin) valid = begin;
+    if(valid > head) valid = head;
+    memmove(out, out + (valid - begin), (size_t)(head - valid) * sizeof(*out));
+    *first = valid;
+    return (size_t)(head - valid);
+}
+
+static void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put64(uint8_t* p, uint64_t v)
+{
+    for(int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+bool chip8_trace_write(Chip8* c, const char* path)
+{
+    if(c->trace == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Tracing is not running\n");
+        return false;
+    }
+    chip8_trace_flush(c);
+
+    const size_t capacity = (size_t)c->trace->mask + 1;
+    Chip8_Trace_Record* records = chip8_malloc(capacity * sizeof(*records));
+    if(records == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Out of memory for writing the trace\n");
+        return false;
+    }
+    uint64_t first;
+    const size_t count = chip8_trace_snapshot(c, records, capacity, &first);
+
+    FILE* f = fopen(path, "wb");
+    if(f == NULL) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Could not open %s for writing\n", path);
+        chip8_free(records);
+        return false;
+    }
+    uint8_t header[CHIP8_TRACE_HEADER_SIZE];
+    memcpy(header, CHIP8_TRACE_MAGIC, 4);
+    put16(header + 4, CHIP8_TRACE_VERSION);
+    put16(header + 6, CHIP8_TRACE_RECORD_SIZE);
+    put64(header + 8, first);
+    put64(header + 16, count);
+    bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    for(size_t i = 0; ok && i < count; i++) {
+        uint8_t record[CHIP8_TRACE_RECORD_SIZE];
+        put16(record, records[i].pc);
+        put16(record + 2, records[i].opcode);
+        put16(record + 4, records[i].I);
+        put16(record + 6, records[i].changed);
+        ok = fwrite(record, 1, sizeof(record), f) == sizeof(record);
+    }
+    ok = fclose(f) == 0 && ok;
+    chip8_free(records);
+    if(!ok) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Failed to write trace %s\n", path);
+    }
+    return ok;
+}
+
+#endif // NDEBUG
+
+// Mirrors chip8_decode_handler, opcodes it does not know come out as DW
+size_t chip8_disassemble(uint16_t opcode, char* out, size_t size)
+{
+    const unsigned x = (opcode >> 8) & 0xF, y = (opcode >> 4) & 0xF;
+    const unsigned n = opcode & 0xF, nn = opcode & 0xFF, nnn = opcode & 0xFFF;
+    int length = -1;
+    switch(opcode >> 12) {
+        case 0x0:
+            if(nn == 0xE0) length = snprintf(out, size, "CLS");
+            else if(nn == 0xEE) length = snprintf(out, size, "RET");
+            else if(nn == 0xFE) length = snprintf(out, size, "LOW");
+            else if(nn == 0xFF) length = snprintf(out, size, "HIGH");
+            break;
+        case 0x1: length = snprintf(out, size, "JP 0x%03X", nnn); break;
+        case 0x2: length = snprintf(out, size, "CALL 0x%03X", nnn); break;
+        case 0x3: length = snprintf(out, size, "SE V%X, 0x%02X", x, nn); break;
+        case 0x4: length = snprintf(out, size, "SNE V%X, 0x%02X", x, nn); break;
+        case 0x5: length = snprintf(out, size, "SE V%X, V%X", x, y); break;
+        case 0x6: length = snprintf(out, size, "LD V%X, 0x%02X", x, nn); break;
+        case 0x7: length = snprintf(out, size, "ADD V%X, 0x%02X", x, nn); break;
+        case 0x8:
+            {
+                static const char* const names[16] = {
+                    "LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+                    NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL,
+                };
+                if(names[n] != NULL) length = snprintf(out, size, "%s V%X, V%X", names[n], x, y);
+            } break;
+        case 0x9: length = snprintf(out, size, "SNE V%X, V%X", x, y); break;
+        case 0xA: length = snprintf(out, size, "LD I, 0x%03X", nnn); break;
+        case 0xB: length = snprintf(out, size, "JP V0, 0x%03X", nnn); break;
+        case 0xC: length = snprintf(out, size, "RND V%X, 0x%02X", x, nn); break;
+        case 0xD: length = snprintf(out, size, "DRW V%X, V%X, %u", x, y, n); break;
+        case 0xE:
+            if(nn == 0x9E) length = snprintf(out, size, "SKP V%X", x);
+            else if(nn == 0xA1) length = snprintf(out, size, "SKNP V%X", x);
+            break;
+        case 0xF:
+            switch(nn) {
+                case 0x07: length = snprintf(out, size, "LD V%X, DT", x); break;
+                case 0x0A: length = snprintf(out, size, "LD V%X, K", x); break;
+                case 0x15: length = snprintf(out, size, "LD DT, V%X", x); break;
+                case 0x18: length = snprintf(out, size, "LD ST, V%X", x); break;
+                case 0x1E: length = snprintf(out, size, "ADD I, V%X", x); break;
+                case 0x29: length = snprintf(out, size, "LD F, V%X", x); break;
+                case 0x33: length = snprintf(out, size, "LD B, V%X", x); break;
+                case 0x55: length = snprintf(out, size, "LD [I], V%X", x); break;
+                case 0x65: length = snprintf(out, size, "LD V%X, [I]", x); break;
+            }
+            break;
+    }
+    if(length < 0) {
+        length = snprintf(out, size, "DW 0x%04X", opcode);
+    }
+    return length < 0 ? 0 : (size_t)length;
+}
@@ -0,0 +1,875 @@
+// raylib front end, a thin client of the core in chip8.c
+#include "chip8.h"
+
+#include <raylib.h>
+#include <rlgl.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#define CHIP8_DEFAULT_SCALE_FACTOR 10
+#define BEEP_SAMPLE_RATE 44100
+#define BEEP_FREQUENCY 440
+// A little over a minute of history for most ROMs
+#define CHIP8_DEFAULT_REWIND_KIB 256
+// Instructions kept by --trace, the last ones before F3 or quitting
+#define TRACE_CAPACITY (1 << 20)
+// Entries per table in the report F2 and quitting print in a profiling build
+#define PROFILE_REPORT_TOP 16
+// Turbo only hands every Nth frame to the presenter and the rewind history
+#define TURBO_PRESENT_EVERY 16
+// How often the speed shown in turbo is measured, in seconds
+#define SPEED_INTERVAL 0.25
+
+typedef struct {
+    uint32_t window_width, window_height;
+    Color fg_color, bg_color;
+    uint32_t scale_factor;
+    const char* rom_name;
+    bool with_pixel_outlines;
+    uint32_t instructions_per_frame; // CPU clock is this times CHIP8_FRAME_RATE
+    uint64_t bench_instructions; // run headless and compare dispatchers when > 0
+    uint32_t bench_lanes; // instances stepped together by the lockstep engine
+    size_t rewind_budget; // bytes of rewind history, 0 turns rewinding off
+    uint32_t seed; // seed of CXNN, 0 picks one from the clock
+    const char* record_path; // write the keypad of this run to a replay file
+    const char* replay_path; // play a replay file back, it brings its own ROM
+    const char* trace_path; // debug builds keep an instruction trace for this file
+    bool turbo; // start in turbo, Tab toggles it
+} Config;
+
+void set_config_from_args(Config* cfg, int argc, const char** argv)
+{
+    cfg->rom_name = NULL;
+    cfg->scale_factor = CHIP8_DEFAULT_SCALE_FACTOR;
+    cfg->with_pixel_outlines = true;
+    cfg->fg_color = RED;
+    cfg->bg_color = BLACK;
+    cfg->bench_instructions = 0;
+    cfg->bench_lanes = 256;
+    cfg->rewind_budget = CHIP8_DEFAULT_REWIND_KIB * 1024;
+    cfg->seed = 0;
+    cfg->record_path = NULL;
+    cfg->replay_path = NULL;
+    cfg->trace_path = NULL;
+    cfg->turbo = false;
+    cfg->instructions_per_frame = CHIP8_DEFAULT_CPU_HZ / CHIP8_FRAME_RATE;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            cfg->bench_instructions = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            cfg->bench_lanes = (uint32_t)strtoul(argv[++i], NULL, 10);
+            if(cfg->bench_lanes == 0) cfg->bench_lanes = 1;
+        } else if(strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+            uint32_t hz = (uint32_t)strtoul(argv[++i], NULL, 10);
+            cfg->instructions_per_frame = hz < CHIP8_FRAME_RATE ? 1 : hz / CHIP8_FRAME_RATE;
+        } else if(strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            cfg->rewind_budget = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            cfg->seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            cfg->record_path = argv[++i];
+        } else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            cfg->replay_path = argv[++i];
+        } else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            cfg->trace_path = argv[++i];
+        } else if(strcmp(argv[i], "--turbo") == 0) {
+            cfg->turbo = true;
+        } else {
+            cfg->rom_name = argv[i];
+        }
+    }
+}
+
+
+// The emulation runs on its own thread and owns the Chip8 until it is
+// joined, the main thread only polls raylib and presents frames. Everything
+// it has to say goes through these atomics: the hotkeys as command bits the
+// emulation thread takes once per frame, the keypad as a bitmask.
+enum {
+    COMMAND_PAUSE = 1 << 0, // toggled, pressing twice in a frame cancels out
+    COMMAND_SAVE = 1 << 1,
+    COMMAND_LOAD = 1 << 2,
+    COMMAND_TRACE = 1 << 3,
+    COMMAND_PROFILE = 1 << 4,
+};
+static atomic_uint commands;
+static atomic_uint keypad_bits; // bit k set while CHIP-8 key k is down
+static atomic_bool rewind_held; // Backspace steps back one frame per frame
+static atomic_bool turbo; // run as fast as the host allows
+static atomic_bool quit;
+
+// An instance blocked in FX0A (see chip8_blocked) has nothing to do until a
+// key goes down, the emulation thread sleeps on input_changed instead of
+// running frames. handle_input bumps input_events whenever anything the
+// emulation thread reacts to changed.
+static mtx_t input_lock;
+static cnd_t input_changed;
+static atomic_uint input_events;
+
+static void signal_input(void)
+{
+    mtx_lock(&input_lock);
+    atomic_fetch_add(&input_events, 1);
+    cnd_signal(&input_changed);
+    mtx_unlock(&input_lock);
+}
+
+// Returns once input_events moved past seen
+static void wait_for_input(unsigned int seen)
+{
+    mtx_lock(&input_lock);
+    while(atomic_load(&input_events) == seen) {
+        cnd_wait(&input_changed, &input_lock);
+    }
+    mtx_unlock(&input_lock);
+}
+
+// F5 keeps a snapshot in memory, F9 goes back to it
+static uint8_t quicksave[CHIP8_STATE_MAX_SIZE];
+static size_t quicksave_size = 0;
+
+#ifndef NDEBUG
+// F3 writes the instruction trace here
+static const char* trace_path = NULL;
+#endif
+
+// The usual mapping of the COSMAC VIP hex keypad onto the left of a QWERTY
+// keyboard, indexed by CHIP-8 key
+//   1 2 3 C      1 2 3 4
+//   4 5 6 D  ->  Q W E R
+//   7 8 9 E      A S D F
+//   A 0 B F      Z X C V
+static const int keymap[16] = {
+    KEY_X, KEY_ONE, KEY_TWO, KEY_THREE,
+    KEY_Q, KEY_W, KEY_E, KEY_A,
+    KEY_S, KEY_D, KEY_Z, KEY_C,
+    KEY_FOUR, KEY_R, KEY_F, KEY_V,
+};
+
+// Main thread side, runs after every PollInputEvents
+void handle_input(void)
+{
+    unsigned int keys = 0;
+    for(int i = 0; i < 16; i++) {
+        if(IsKeyDown(keymap[i])) keys |= 1u << i;
+    }
+    const bool rewinding = IsKeyDown(KEY_BACKSPACE);
+    // Every branch below but the last one is something to wake up for
+    bool changed = true;
+    const bool keys_changed = atomic_exchange(&keypad_bits, keys) != keys;
+    const bool rewind_changed = atomic_exchange(&rewind_held, rewinding) != rewinding;
+
+    if(WindowShouldClose()) {
+        atomic_store(&quit, true);
+    } else if(IsKeyPressed(KEY_SPACE)) {
+        atomic_fetch_xor(&commands, COMMAND_PAUSE);
+    } else if(IsKeyPressed(KEY_TAB)) {
+        // Only this thread writes it
+        const bool on = !atomic_load(&turbo);
+        atomic_store(&turbo, on);
+        TraceLog(LOG_INFO, on ? "===== Turbo =====\n" : "===== Normal speed =====\n");
+    } else if(IsKeyPressed(KEY_F5)) {
+        atomic_fetch_or(&commands, COMMAND_SAVE);
+    } else if(IsKeyPressed(KEY_F9)) {
+        atomic_fetch_or(&commands, COMMAND_LOAD);
+#ifndef NDEBUG
+    } else if(IsKeyPressed(KEY_F3)) {
+        atomic_fetch_or(&commands, COMMAND_TRACE);
+#endif
+#ifdef CHIP8_PROFILE
+    } else if(IsKeyPressed(KEY_F2)) {
+        atomic_fetch_or(&commands, COMMAND_PROFILE);
+#endif
+    } else {
+        changed = false;
+    }
+    if(changed || keys_changed || rewind_changed) {
+        signal_input();
+    }
+}
+
+// Emulation thread side, carries out what handle_input asked for
+void run_commands(Chip8* c)
+{
+    const unsigned int pending = atomic_exchange(&commands, 0);
+    if(pending & COMMAND_PAUSE) {
+        if(c->state == EMULATOR_PAUSED) {
+            c->state = EMULATOR_RUNNING;
+            TraceLog(LOG_INFO, "===== Running =====\n");
+        } else {
+            c->state = EMULATOR_PAUSED;
+            TraceLog(LOG_INFO, "===== Paused =====\n");
+        }
+    }
+    if(pending & COMMAND_SAVE) {
+        quicksave_size = chip8_save_state(c, quicksave, sizeof(quicksave));
+        TraceLog(LOG_INFO, "State saved, %zu bytes, hash %016llx\n", quicksave_size,
+                (unsigned long long)chip8_state_hash(quicksave, quicksave_size));
+    }
+    if(pending & COMMAND_LOAD) {
+        if(c->replay != NULL && !c->replay->playing) {
+            // The replay could not tell how the run got to that state
+            TraceLog(LOG_WARNING, "Loading a state is not possible while recording\n");
+        } else if(quicksave_size == 0) {
+            TraceLog(LOG_WARNING, "No state saved yet, press F5 first\n");
+        } else if(chip8_load_state(c, quicksave, quicksave_size)) {
+            TraceLog(LOG_INFO, "State loaded\n");
+        }
+    }
+#ifndef NDEBUG
+    if((pending & COMMAND_TRACE) && trace_path != NULL) {
+        if(chip8_trace_write(c, trace_path)) {
+            TraceLog(LOG_INFO, "Trace written to %s\n", trace_path);
+        }
+    }
+#endif
+#ifdef CHIP8_PROFILE
+    if(pending & COMMAND_PROFILE) {
+        chip8_profile_report(c, PROFILE_REPORT_TOP);
+    }
+#endif
+}
+
+// Host callbacks handed to the core, CXNN uses the seeded generator of the
+// core so a run can be replayed
+
+static void host_log(void* user, Chip8_Log_Level level, const char* message)
+{
+    (void)user;
+    static const int levels[] = { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR };
+    TraceLog(levels[level], "%s", message);
+}
+
+static void host_input(void* user, bool keypad[16])
+{
+    (void)user;
+    const unsigned int keys = atomic_load(&keypad_bits);
+    for(int i = 0; i < 16; i++) {
+        keypad[i] = (keys >> i) & 1;
+    }
+}
+
+// The tone is a square wave generated on the audio thread, host_audio only
+// flips it on and off
+static atomic_bool beep_on;
+
+static void beep_callback(void* buffer, unsigned int frames)
+{
+    static uint32_t phase = 0;
+    int16_t* samples = buffer;
+    for(unsigned int i = 0; i < frames; i++) {
+        const bool high = (phase++ / (BEEP_SAMPLE_RATE / BEEP_FREQUENCY / 2)) & 1;
+        samples[i] = beep_on ? (high ? 3000 : -3000) : 0;
+    }
+}
+
+static void host_audio(void* user, bool on)
+{
+    (void)user;
+    beep_on = on;
+}
+
+// A finished frame, the part of the core the presenter needs
+typedef struct {
+    uint64_t display[CHIP8_DISPLAY_WORDS][CHIP8_HIRES_HEIGHT];
+    bool hires;
+    bool turbo; // show the speed below on top
+    double speed; // emulated time over real time
+    double instructions_per_second;
+} Frame;
+
+// Frames go from the emulation thread to the main thread through a triple
+// buffer. The emulation thread fills frames[back] and the main thread shows
+// frames[front], publishing or picking up a frame swaps index with the
+// third one in the middle, so neither side ever waits on the other.
+// FRAME_FRESH marks a middle frame the main thread has not picked up yet.
+#define FRAME_FRESH 4u
+typedef struct {
+    Frame frames[3];
+    atomic_uint middle;
+    unsigned int back; // emulation thread only
+    unsigned int front; // main thread only
+} Frame_Exchange;
+
+void frame_exchange_init(Frame_Exchange* x)
+{
+    x->back = 0;
+    atomic_init(&x->middle, 1);
+    x->front = 2;
+}
+
+void frame_publish(Frame_Exchange* x, const Chip8* c, bool turbo, double speed, double instructions_per_second)
+{
+    Frame* f = &x->frames[x->back];
+    memcpy(f->display, c->display, sizeof(f->display));
+    f->hires = c->hires;
+    f->turbo = turbo;
+    f->speed = speed;
+    f->instructions_per_second = instructions_per_second;
+    x->back = atomic_exchange(&x->middle, x->back | FRAME_FRESH) & 3;
+}
+
+// The most recent frame published, NULL when there was none since the last call
+const Frame* frame_latest(Frame_Exchange* x)
+{
+    if((atomic_load(&x->middle) & FRAME_FRESH) == 0) {
+        return NULL;
+    }
+    x->front = atomic_exchange(&x->middle, x->front) & 3;
+    return &x->frames[x->front];
+}
+
+// The display is presented as one streaming texture. Each frame the
+// framebuffer is expanded to RGBA, uploaded and drawn as a single scaled quad,
+// so the draw call count no longer depends on the number of pixels.
+typedef struct {
+    Texture2D texture; // always hires sized, lores only uses its top-left part
+    Color pixels[CHIP8_HIRES_WIDTH*CHIP8_HIRES_HEIGHT];
+    Frame shown; // what the texture holds
+    bool stale; // the texture holds nothing yet
+} Screen;
+
+bool screen_init(Screen* s)
+{
+    Image image = GenImageColor(CHIP8_HIRES_WIDTH, CHIP8_HIRES_HEIGHT, BLANK);
+    s->texture = LoadTextureFromImage(image);
+    UnloadImage(image);
+    if(s->texture.id == 0) {
+        return false;
+    }
+    SetTextureFilter(s->texture, TEXTURE_FILTER_POINT);
+    s->stale = true;
+    return true;
+}
+
+void screen_deinit(Screen* s)
+{
+    UnloadTexture(s->texture);
+}
+
+// Only the rows that differ from the frame shown before are converted and
+// uploaded, the rest of the texture still holds them. Frames the main thread
+// never picked up don't matter that way. Returns false without touching the
+// window when nothing changed since the last call, in turbo the speed
+// readout changes every time.
+bool update_screen(Screen* s, const Frame* f, Config cfg)
+{
+    // The window keeps its size in hires mode, the pixels get smaller instead
+    const uint32_t width = CHIP8_WIDTH(f);
+    const uint32_t height = CHIP8_HEIGHT(f);
+    const float pixel_size = (float)cfg.scale_factor * CHIP8_DEFAULT_WINDOW_WIDTH / width;
+
+    uint64_t dirty_rows = 0;
+    if(s->stale || f->hires != s->shown.hires) {
+        dirty_rows = ~0ull;
+    } else {
+        for(uint32_t y = 0; y < height; y++) {
+            for(uint32_t w = 0; w < (width + 63) / 64; w++) {
+                if(f->display[w][y] != s->shown.display[w][y]) dirty_rows |= 1ull << y;
+            }
+        }
+    }
+    if(dirty_rows == 0 && !f->turbo && !s->shown.turbo) {
+        return false;
+    }
+    s->shown = *f;
+    s->stale = false;
+
+    uint32_t y = 0;
+    while(y < height) {
+        if(((dirty_rows >> y) & 1) == 0) {
+            y++;
+            continue;
+        }
+
+        // Convert a run of consecutive dirty rows and upload it in one go
+        const uint32_t first = y;
+        for(; y < height && ((dirty_rows >> y) & 1); y++) {
+            Color* p = &s->pixels[y*width];
+            for(uint32_t w = 0; w < (width + 63) / 64; w++) {
+                const uint64_t row = f->display[w][y];
+                for(uint32_t x = 0; x < 64 && 64*w + x < width; x++) {
+                    *p++ = (row >> (63 - x)) & 1 ? cfg.fg_color : cfg.bg_color;
+                }
+            }
+        }
+        UpdateTextureRec(s->texture, (Rectangle){ 0, (float)first, (float)width, (float)(y - first) },
+                &s->pixels[first*width]);
+    }
+
+    // The back buffer is undefined after a swap, so the quad is always
+    // redrawn whole
+    const Rectangle src = { 0, 0, (float)width, (float)height };
+    DrawTexturePro(s->texture, src,
+            (Rectangle){ 0, 0, width * pixel_size, height * pixel_size },
+            (Vector2){ 0, 0 }, 0.0f, WHITE);
+
+    if(cfg.with_pixel_outlines) {
+        // A background colored grid, only visible on top of lit pixels
+        for(uint32_t i = 0; i <= width; i++) {
+            DrawRectangleRec((Rectangle){ i * pixel_size, 0, 1.0f, height * pixel_size }, cfg.bg_color);
+        }
+        for(uint32_t i = 0; i <= height; i++) {
+            DrawRectangleRec((Rectangle){ 0, i * pixel_size, width * pixel_size, 1.0f }, cfg.bg_color);
+        }
+    }
+
+    if(f->turbo) {
+        const char* text = TextFormat("x%.1f  %.2f MIPS", f->speed, f->instructions_per_second / 1e6);
+        DrawRectangle(0, 0, MeasureText(text, 20) + 16, 32, Fade(cfg.bg_color, 0.75f));
+        DrawText(text, 8, 6, 20, RAYWHITE);
+    }
+
+    // Frame control is manual, nothing else flushes the batch before the swap
+    rlDrawRenderBatchActive();
+    SwapScreenBuffer();
+    return true;
+}
+
+double get_time_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+typedef uint64_t (*Chip8_Runner)(Chip8* c, uint64_t count);
+
+void bench_report(const char* name, uint64_t executed, double elapsed)
+{
+    printf("%-8s %12llu instructions in %8.4fs  %8.2f MIPS  %6.2f ns/inst\n",
+            name, (unsigned long long)executed, elapsed,
+            (double)executed / elapsed / 1e6, elapsed * 1e9 / (double)executed);
+}
+
+void bench_dispatcher(Chip8* c, Config conf, const char* name, Chip8_Runner run)
+{
+    double start = get_time_seconds();
+    uint64_t executed = run(c, conf.bench_instructions);
+    bench_report(name, executed, get_time_seconds() - start);
+}
+
+bool same_state(const Chip8* a, const Chip8* b)
+{
+    return a->PC == b->PC && a->I == b->I
+        && memcmp(a->V, b->V, sizeof(a->V)) == 0
+        && memcmp(a->ram, b->ram, sizeof(a->ram)) == 0
+        && memcmp(a->display, b->display, sizeof(a->display)) == 0;
+}
+
+#define BENCH_RNG_SEED 0x2545F491u
+
+// xorshift32 with the state behind user, every instance in the benchmark
+// gets its own copy so they all see the same CXNN values
+static uint8_t bench_random(void* user)
+{
+    uint32_t* state = user;
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (uint8_t)*state;
+}
+
+// The benchmark runs on the core alone, no window or raylib involved
+bool bench_instance_init(Chip8* c, Config conf, uint32_t* rng)
+{
+    *rng = BENCH_RNG_SEED;
+    const Chip8_Host host = { .user = rng, .random = bench_random };
+    return chip8_init(c, &host) && chip8_load_rom_file(c, conf.rom_name);
+}
+
+// Steps conf.bench_lanes copies of the ROM through the lockstep engine for
+// the same total instruction count, then checks the lanes against the
+// interpreter run for as many instructions as each lane did.
+int bench_soa(Config conf, const Chip8* prototype, Chip8* scratch)
+{
+    const uint64_t rounds = conf.bench_instructions / conf.bench_lanes > 0
+        ? conf.bench_instructions / conf.bench_lanes : 1;
+    uint32_t* rngs = malloc(sizeof(*rngs) * conf.bench_lanes);
+    Chip8_Soa* soa = chip8_soa_create(prototype, conf.bench_lanes);
+    if(rngs == NULL || soa == NULL) {
+        free(rngs);
+        chip8_soa_destroy(soa);
+        TraceLog(LOG_ERROR, "Failed to create %u lanes\n", conf.bench_lanes);
+        return 69;
+    }
+    memcpy(scratch, prototype, sizeof(*scratch));
+    for(uint32_t i = 0; i < conf.bench_lanes; i++) {
+        rngs[i] = BENCH_RNG_SEED;
+        scratch->host.user = &rngs[i];
+        chip8_soa_write(soa, i, scratch);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "soa x%u", conf.bench_lanes);
+    double start = get_time_seconds();
+    uint64_t executed = chip8_step_batch(soa, rounds);
+    bench_report(name, executed, get_time_seconds() - start);
+
+    int result = 0;
+    static Chip8 reference, lane;
+    uint32_t rng;
+    if(!bench_instance_init(&reference, conf, &rng)) {
+        result = 69;
+    } else {
+        chip8_run_switch(&reference, rounds);
+        for(uint32_t i = 0; i < conf.bench_lanes; i++) {
+            chip8_soa_read(soa, i, &lane);
+            if(!same_state(&reference, &lane)) {
+                TraceLog(LOG_ERROR, "soa lane %u diverged from the switch dispatcher\n", i);
+                result = 1;
+                break;
+            }
+        }
+        chip8_deinit(&reference);
+    }
+
+    chip8_soa_destroy(soa);
+    free(rngs);
+    return result;
+}
+
+// Runs the ROM headless through every dispatcher compiled in and prints the
+// throughput of each, then checks they all ended up in the same state.
+int run_dispatch_benchmark(Config conf)
+{
+    static Chip8 reference, other;
+    uint32_t rng;
+    int result = 0;
+
+    if(!bench_instance_init(&reference, conf, &rng))
+        return 69;
+    bench_dispatcher(&reference, conf, "switch", chip8_run_switch);
+
+#ifdef CHIP8_THREADED_DISPATCH
+    if(!bench_instance_init(&other, conf, &rng))
+        return 69;
+    bench_dispatcher(&other, conf, "threaded", chip8_run_threaded);
+    if(!same_state(&reference, &other)) {
+        TraceLog(LOG_ERROR, "threaded dispatcher diverged from the switch dispatcher\n");
+        result = 1;
+    }
+#else
+    printf("threaded dispatcher not compiled in (build with -DCHIP8_THREADED_DISPATCH)\n");
+#endif
+
+#ifdef CHIP8_JIT
+    if(!bench_instance_init(&other, conf, &rng))
+        return 69;
+    if(chip8_jit_init(&other)) {
+        bench_dispatcher(&other, conf, "jit", chip8_run_jit);
+        if(!same_state(&reference, &other)) {
+            TraceLog(LOG_ERROR, "jit diverged from the switch dispatcher\n");
+            result = 1;
+        }
+        chip8_deinit(&other);
+    } else {
+        printf("jit is not supported on this host\n");
+    }
+#else
+    printf("jit not compiled in (build with -DCHIP8_JIT)\n");
+#endif
+
+#ifdef CHIP8_AOT
+    if(!bench_instance_init(&other, conf, &rng))
+        return 69;
+    if(chip8_aot_matches(&other)) {
+        bench_dispatcher(&other, conf, "aot", chip8_run_aot);
+        if(!same_state(&reference, &other)) {
+            TraceLog(LOG_ERROR, "aot translation diverged from the switch dispatcher\n");
+            result = 1;
+        }
+    } else {
+        printf("aot translation linked in was made from a different ROM\n");
+    }
+#else
+    printf("aot not compiled in (translate the ROM with chip8-aot and build with -DCHIP8_AOT)\n");
+#endif
+
+    chip8_deinit(&reference);
+
+    // The lockstep engine starts its lanes from a fresh copy of the ROM,
+    // reference is free to be used as scratch from here on
+    if(!bench_instance_init(&other, conf, &rng))
+        return 69;
+    int soa_result = bench_soa(conf, &other, &reference);
+    if(soa_result != 0)
+        result = soa_result;
+
+    return result;
+}
+
+void sleep_seconds(double seconds)
+{
+    const time_t whole = (time_t)seconds;
+    const struct timespec duration = { whole, (long)((seconds - (double)whole) * 1e9) };
+    thrd_sleep(&duration, NULL);
+}
+
+typedef struct {
+    Chip8* chip8;
+    Chip8_Replay* replay;
+    Chip8_Rewind* rewind; // NULL when rewinding is off
+    Frame_Exchange* frames;
+    uint32_t instructions_per_frame;
+} Emulation;
+
+// Every frame runs a fixed batch of instructions, ticks the timers once and
+// publishes the display if it changed. Frames are scheduled against an
+// absolute deadline on this thread's own clock, so a late frame is made up
+// for by a shorter wait on the next one and a main thread stuck in
+// SwapScreenBuffer or a window drag does not slow the emulation down.
+// Turbo drops the wait and runs frames back to back. While the instance is
+// blocked in FX0A the thread sleeps until handle_input reports a change.
+int emulation_thread(void* arg)
+{
+    Emulation* e = arg;
+    Chip8* c = e->chip8;
+    const double frame_time = 1.0 / CHIP8_FRAME_RATE;
+    double next_frame = get_time_seconds();
+
+    double speed = 0.0, instructions_per_second = 0.0;
+    double interval_start = next_frame;
+    uint64_t interval_frames = 0, interval_cycles = c->cycles;
+    uint64_t frame = 0;
+    while(!atomic_load(&quit)) {
+        // Taken before anything is read, input arriving after this is not lost
+        const unsigned int events = atomic_load(&input_events);
+        run_commands(c);
+
+        const bool rewinding = atomic_load(&rewind_held);
+        // Paused or rewinding goes at the normal pace even in turbo
+        const bool fast = atomic_load(&turbo) && c->state == EMULATOR_RUNNING && !rewinding;
+        // Everything but the emulation itself is done once every
+        // TURBO_PRESENT_EVERY frames in turbo
+        const bool present = !fast || ++frame % TURBO_PRESENT_EVERY == 0;
+        if(rewinding && e->rewind != NULL) {
+            chip8_rewind_pop(e->rewind, c);
+        } else if(c->state == EMULATOR_RUNNING) {
+            chip8_run_frame(c, e->instructions_per_frame);
+            interval_frames++;
+            if(e->rewind != NULL && present) chip8_rewind_push(e->rewind, c);
+        }
+        if(c->replay != NULL && c->replay->playing && c->cycles >= e->replay->cycles) {
+            // The keyboard takes over from here
+            const bool same = chip8_replay_hash(c) == e->replay->state_hash;
+            TraceLog(same ? LOG_INFO : LOG_WARNING, "Replay finished after %llu cycles, %s\n",
+                    (unsigned long long)c->cycles, same ? "state matches" : "state DIFFERS from the recording");
+            c->replay = NULL;
+        }
+        if((c->state != EMULATOR_RUNNING || rewinding) && atomic_load(&beep_on)) {
+            // Silence the tone while paused or rewinding, the next frame turns it back on
+            host_audio(NULL, false);
+            c->beeping = false;
+        }
+        // A replay brings its own keys, it has to keep running frames
+        const bool blocked = c->state == EMULATOR_RUNNING && !rewinding && chip8_blocked(c)
+            && (c->replay == NULL || !c->replay->playing);
+        if(!present && !blocked) {
+            continue;
+        }
+
+        const double now = get_time_seconds();
+        if(now - interval_start >= SPEED_INTERVAL) {
+            speed = (double)interval_frames / CHIP8_FRAME_RATE / (now - interval_start);
+            instructions_per_second = (double)(c->cycles - interval_cycles) / (now - interval_start);
+            interval_start = now;
+            interval_frames = 0;
+            interval_cycles = c->cycles;
+        }
+        if(c->dirty_rows != 0 || fast) {
+            frame_publish(e->frames, c, fast, speed, instructions_per_second);
+            c->dirty_rows = 0;
+        }
+
+        next_frame += frame_time;
+        if(blocked) {
+            wait_for_input(events);
+            next_frame = get_time_seconds();
+        } else if(fast) {
+            next_frame = now;
+        } else if(next_frame > now) {
+            sleep_seconds(next_frame - now);
+        } else if(now - next_frame > frame_time) {
+            // Too far behind (suspended, debugger...), don't try to catch up
+            next_frame = now;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, const char** argv)
+{
+    Config conf;
+    Chip8 chip8;
+
+    set_config_from_args(&conf, argc, argv);
+    if(conf.rom_name == NULL && (conf.replay_path == NULL || conf.bench_instructions > 0)) {
+        TraceLog(LOG_FATAL, "USAGE: %s <path to rom> [--hz <cpu clock>] [--seed <n>] [--rewind <KiB>] [--turbo] "
+                "[--record <replay>] [--trace <file>] [--bench <instructions> [--lanes <n>]]\n", argv[0]);
+        TraceLog(LOG_FATAL, "       %s --replay <replay>\n", argv[0]);
+        return 69;
+    }
+
+    if(conf.bench_instructions > 0)
+        return run_dispatch_benchmark(conf);
+
+    InitWindow(CHIP8_DEFAULT_WINDOW_WIDTH*conf.scale_factor,
+            CHIP8_DEFAULT_WINDOW_HEIGHT*conf.scale_factor,
+            "CHIP-8 Emulator");
+#ifndef NDEBUG
+    SetTraceLogLevel(LOG_DEBUG);
+#endif
+
+    static Screen screen;
+    if(!screen_init(&screen)) {
+        TraceLog(LOG_FATAL, "Failed to create the screen texture\n");
+        CloseWindow();
+        return 69;
+    }
+
+    const Chip8_Host host = {
+        .log = host_log,
+        .input = host_input,
+        .audio = host_audio,
+    };
+    static Chip8_Replay replay;
+    const uint32_t seed = conf.seed != 0 ? conf.seed : (uint32_t)time(NULL);
+    bool loaded = chip8_init(&chip8, &host);
+    if(loaded && conf.replay_path != NULL) {
+        loaded = chip8_replay_load(&chip8, &replay, conf.replay_path) && chip8_replay_play(&chip8, &replay);
+        // Frames have to be cut at the same cycles as when recording
+        conf.instructions_per_frame = replay.instructions_per_frame;
+    } else if(loaded && conf.record_path != NULL) {
+        unsigned int size = 0;
+        unsigned char* rom = LoadFileData(conf.rom_name, &size);
+        loaded = rom != NULL && chip8_replay_record(&chip8, &replay, rom, (size_t)size, seed,
+                conf.instructions_per_frame);
+        UnloadFileData(rom);
+    } else if(loaded) {
+        loaded = chip8_load_rom_file(&chip8, conf.rom_name);
+        chip8_seed(&chip8, seed);
+        TraceLog(LOG_INFO, "Seed %u\n", seed);
+    }
+    if(!loaded) {
+        chip8_replay_free(&replay);
+        TraceLog(LOG_FATAL, "Failed to create CHIP-8 instance\n");
+        screen_deinit(&screen);
+        CloseWindow();
+        return 69;
+    }
+
+#ifdef CHIP8_JIT
+    if(!chip8_jit_init(&chip8)) {
+        TraceLog(LOG_WARNING, "JIT is not available, falling back to the interpreter\n");
+    }
+#endif
+
+#ifdef CHIP8_AOT
+    chip8.aot = chip8_aot_matches(&chip8);
+    if(!chip8.aot) {
+        TraceLog(LOG_WARNING, "ROM does not match the linked AOT translation, falling back to the interpreter\n");
+    }
+#endif
+
+    // Sound is optional, keep going silently without an audio device
+    AudioStream beep = { 0 };
+    InitAudioDevice();
+    if(IsAudioDeviceReady()) {
+        beep = LoadAudioStream(BEEP_SAMPLE_RATE, 16, 1);
+        SetAudioStreamCallback(beep, beep_callback);
+        PlayAudioStream(beep);
+    }
+
+    if(conf.trace_path != NULL) {
+#ifndef NDEBUG
+        if(chip8_trace_start(&chip8, TRACE_CAPACITY)) trace_path = conf.trace_path;
+#else
+        TraceLog(LOG_WARNING, "Tracing needs a build without NDEBUG\n");
+#endif
+    }
+
+    Chip8_Rewind* rewind = NULL;
+    if(conf.rewind_budget > 0) {
+        rewind = chip8_rewind_create(conf.rewind_budget);
+        if(rewind == NULL) {
+            TraceLog(LOG_WARNING, "Rewind budget of %zu KiB is too small, rewinding is off\n", conf.rewind_budget / 1024);
+        }
+    }
+
+    static Frame_Exchange frames;
+    frame_exchange_init(&frames);
+    atomic_store(&turbo, conf.turbo);
+    Emulation emulation = {
+        .chip8 = &chip8,
+        .replay = &replay,
+        .rewind = rewind,
+        .frames = &frames,
+        .instructions_per_frame = conf.instructions_per_frame,
+    };
+    thrd_t emulation_id;
+    const bool started = mtx_init(&input_lock, mtx_plain) == thrd_success
+        && cnd_init(&input_changed) == thrd_success
+        && thrd_create(&emulation_id, emulation_thread, &emulation) == thrd_success;
+    if(!started) {
+        TraceLog(LOG_FATAL, "Failed to start the emulation thread\n");
+    }
+
+    // Presents whatever frame the emulation thread finished last, at most
+    // once per frame time. Nothing here waits on the emulation.
+    const double frame_time = 1.0 / CHIP8_FRAME_RATE;
+    double next_frame = GetTime();
+    while(started && !atomic_load(&quit)) {
+        PollInputEvents();
+        handle_input();
+
+        const Frame* frame = frame_latest(&frames);
+        if(frame != NULL) {
+            update_screen(&screen, frame, conf);
+        }
+
+        next_frame += frame_time;
+        const double now = GetTime();
+        if(next_frame > now) {
+            WaitTime(next_frame - now);
+        } else if(now - next_frame > frame_time) {
+            next_frame = now;
+        }
+    }
+    if(started) {
+        thrd_join(emulation_id, NULL);
+        cnd_destroy(&input_changed);
+        mtx_destroy(&input_lock);
+    }
+
+    if(started && chip8.replay != NULL && !chip8.replay->playing) {
+        chip8_replay_finish(&chip8, &replay);
+        if(chip8_replay_save(&chip8, &replay, conf.record_path)) {
+            TraceLog(LOG_INFO, "Recorded %llu cycles, %zu key changes to %s\n",
+                    (unsigned long long)replay.cycles, replay.count, conf.record_path);
+        }
+    }
+#ifdef CHIP8_PROFILE
+    chip8_profile_report(&chip8, PROFILE_REPORT_TOP);
+#endif
+#ifndef NDEBUG
+    if(trace_path != NULL && chip8_trace_write(&chip8, trace_path)) {
+        TraceLog(LOG_INFO, "Trace written to %s\n", trace_path);
+    }
+#endif
+    chip8_replay_free(&replay);
+    chip8_rewind_destroy(rewind);
+    chip8_deinit(&chip8);
+    screen_deinit(&screen);
+    if(IsAudioDeviceReady()) {
+        UnloadAudioStream(beep);
+        CloseAudioDevice();
+    }
+    CloseWindow();
+    return started ? 0 : 69;
+}
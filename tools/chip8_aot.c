@@ -0,0 +1,353 @@
+// chip8-aot: ahead-of-time translation of a CHIP-8 ROM into C.
+//
+//     chip8-aot <rom> [output.c]
+//
+// Walks the control flow graph of the ROM from CHIP8_ROM_B and emits one C
+// function per basic block plus chip8_run_aot/chip8_aot_matches (see
+// chip8.h). Simple register opcodes are emitted as plain C, everything else
+// calls the interpreter's own opcode handlers so semantics can not drift.
+// Dynamic jumps (BNNN), returns into code that was never reached statically
+// and blocks whose bytes were stored to at runtime all fall back to
+// chip8_emulate_instruction.
+//
+// Build the result together with the emulator, ideally with LTO so the
+// handlers get inlined into the blocks:
+//
+//     chip8-aot rom.ch8 rom_aot.c
+//     CFLAGS="-O3 -flto" AOT=rom_aot.c ./build.sh
+#include "chip8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How far a taken skip moves PC past the next instruction, must match
+// chip8_op_3XNN and friends
+#define AOT_SKIP_SIZE 2
+#define AOT_MAX_BLOCK_LENGTH 255
+
+typedef enum {
+    FLOW_NEXT = 0,
+    FLOW_JUMP,
+    FLOW_CALL,
+    FLOW_RETURN,
+    FLOW_SKIP,
+    FLOW_DYNAMIC,
+    FLOW_STORE, // stores into RAM, the next instruction starts a new block
+    FLOW_WAIT, // FX0A, stays on itself until a key goes down
+} Flow;
+
+static uint8_t rom[CHIP8_RAM_CAPACITY];
+static uint32_t rom_end;
+static bool leader[CHIP8_RAM_CAPACITY];
+static bool visited[CHIP8_RAM_CAPACITY];
+static uint16_t worklist[CHIP8_RAM_CAPACITY];
+static uint32_t worklist_count;
+
+static bool in_rom(uint32_t addr)
+{
+    return addr >= CHIP8_ROM_B && addr + 1 < rom_end;
+}
+
+static uint16_t opcode_at(uint16_t addr)
+{
+    return (rom[addr] << 8) | rom[addr+1];
+}
+
+static Flow classify(uint16_t opcode)
+{
+    switch(opcode >> 12) {
+        case 0x0: return opcode == 0x00EE ? FLOW_RETURN : FLOW_NEXT;
+        case 0x1: return FLOW_JUMP;
+        case 0x2: return FLOW_CALL;
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x9: return FLOW_SKIP;
+        case 0xE: return ((opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1) ? FLOW_SKIP : FLOW_NEXT;
+        case 0xB: return FLOW_DYNAMIC;
+        case 0xF:
+            if((opcode & 0xFF) == 0x0A) return FLOW_WAIT;
+            return ((opcode & 0xFF) == 0x33 || (opcode & 0xFF) == 0x55) ? FLOW_STORE : FLOW_NEXT;
+        default: return FLOW_NEXT;
+    }
+}
+
+// Mirrors chip8_decode_handler
+static const char* handler_name(uint16_t opcode)
+{
+    uint8_t n = opcode & 0x0F, nn = opcode & 0xFF;
+    switch(opcode >> 12) {
+        case 0x0:
+            if(nn == 0xE0) return "00E0";
+            if(nn == 0xEE) return "00EE";
+            if(nn == 0xFE) return "00FE";
+            if(nn == 0xFF) return "00FF";
+            return "nop";
+        case 0x1: return "1NNN";
+        case 0x2: return "2NNN";
+        case 0x3: return "3XNN";
+        case 0x4: return "4XNN";
+        case 0x5: return "5XY0";
+        case 0x6: return "6XNN";
+        case 0x7: return "7XNN";
+        case 0x8:
+            switch(n) {
+                case 0x0: return "8XY0";
+                case 0x1: return "8XY1";
+                case 0x2: return "8XY2";
+                case 0x3: return "8XY3";
+                case 0x4: return "8XY4";
+                case 0x5: return "8XY5";
+                case 0x6: return "8XY6";
+                case 0x7: return "8XY7";
+                case 0xE: return "8XYE";
+                default: return "nop";
+            }
+        case 0x9: return "9XY0";
+        case 0xA: return "ANNN";
+        case 0xB: return "BNNN";
+        case 0xC: return "CXNN";
+        case 0xD: return "DXYN";
+        case 0xE:
+            if(nn == 0x9E) return "EX9E";
+            if(nn == 0xA1) return "EXA1";
+            return "nop";
+        case 0xF:
+            switch(nn) {
+                case 0x07: return "FX07";
+                case 0x0A: return "FX0A";
+                case 0x15: return "FX15";
+                case 0x18: return "FX18";
+                case 0x1E: return "FX1E";
+                case 0x29: return "FX29";
+                case 0x33: return "FX33";
+                case 0x55: return "FX55";
+                case 0x65: return "FX65";
+                default: return "nop";
+            }
+        default: return "nop";
+    }
+}
+
+static void add_leader(uint32_t addr)
+{
+    if(!in_rom(addr) || leader[addr])
+        return;
+    leader[addr] = true;
+    worklist[worklist_count++] = addr;
+}
+
+static void build_cfg(void)
+{
+    add_leader(CHIP8_ROM_B);
+    while(worklist_count > 0) {
+        uint16_t addr = worklist[--worklist_count];
+        while(in_rom(addr) && !visited[addr]) {
+            uint16_t opcode = opcode_at(addr);
+            visited[addr] = true;
+
+            Flow flow = classify(opcode);
+            if(flow == FLOW_NEXT) {
+                addr += 2;
+                continue;
+            }
+
+            switch(flow) {
+                case FLOW_JUMP:
+                    add_leader(opcode & 0x0FFF);
+                    break;
+                case FLOW_CALL:
+                    add_leader(opcode & 0x0FFF);
+                    add_leader(addr + 2);
+                    break;
+                case FLOW_SKIP:
+                    add_leader(addr + 2);
+                    add_leader(addr + 2 + AOT_SKIP_SIZE);
+                    break;
+                case FLOW_STORE:
+                case FLOW_WAIT:
+                    add_leader(addr + 2);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        }
+    }
+}
+
+static void emit_inst(FILE* out, uint16_t addr, uint16_t opcode)
+{
+    Inst inst = {
+        .opcode = opcode,
+        .X = (opcode >> 8) & 0x0F,
+        .Y = (opcode >> 4) & 0x0F,
+        .N = opcode & 0x0F,
+        .NN = opcode & 0xFF,
+        .NNN = opcode & 0x0FFF,
+    };
+    const char* name = handler_name(opcode);
+
+    fprintf(out, "    // 0x%04X: %04X\n", addr, opcode);
+    if(strcmp(name, "nop") == 0) {
+        return;
+    } else if(strcmp(name, "1NNN") == 0) {
+        fprintf(out, "    c->PC = 0x%04X;\n", inst.NNN);
+    } else if(strcmp(name, "6XNN") == 0) {
+        fprintf(out, "    c->V[0x%X] = 0x%02X;\n", inst.X, inst.NN);
+    } else if(strcmp(name, "7XNN") == 0) {
+        fprintf(out, "    c->V[0x%X] += 0x%02X;\n", inst.X, inst.NN);
+    } else if(strcmp(name, "8XY0") == 0) {
+        fprintf(out, "    c->V[0x%X] = c->V[0x%X];\n", inst.X, inst.Y);
+    } else if(strcmp(name, "8XY1") == 0) {
+        fprintf(out, "    c->V[0x%X] |= c->V[0x%X];\n", inst.X, inst.Y);
+    } else if(strcmp(name, "8XY2") == 0) {
+        fprintf(out, "    c->V[0x%X] &= c->V[0x%X];\n", inst.X, inst.Y);
+    } else if(strcmp(name, "8XY3") == 0) {
+        fprintf(out, "    c->V[0x%X] ^= c->V[0x%X];\n", inst.X, inst.Y);
+    } else if(strcmp(name, "ANNN") == 0) {
+        fprintf(out, "    c->I = 0x%04X;\n", inst.NNN);
+    } else {
+        Flow flow = classify(opcode);
+        // Handlers that read or change PC expect it past the instruction
+        if(flow == FLOW_CALL || flow == FLOW_RETURN || flow == FLOW_SKIP || flow == FLOW_DYNAMIC
+                || flow == FLOW_WAIT)
+            fprintf(out, "    c->PC = 0x%04X;\n", addr + 2);
+        fprintf(out, "    chip8_op_%s(c, (Inst){ .opcode = 0x%04X, .X = 0x%X, .Y = 0x%X, "
+                ".N = 0x%X, .NN = 0x%02X, .NNN = 0x%03X });\n",
+                name, opcode, inst.X, inst.Y, inst.N, inst.NN, inst.NNN);
+    }
+}
+
+// Emits the block starting at start and returns the address past its end
+static uint16_t emit_block(FILE* out, uint16_t start, uint8_t* length)
+{
+    uint16_t addr = start;
+    bool terminated = false;
+    *length = 0;
+
+    fprintf(out, "static void block_%04X(Chip8* c)\n{\n", start);
+    while(in_rom(addr) && visited[addr] && *length < AOT_MAX_BLOCK_LENGTH) {
+        if(addr != start && leader[addr])
+            break;
+        uint16_t opcode = opcode_at(addr);
+        emit_inst(out, addr, opcode);
+        (*length)++;
+        addr += 2;
+
+        Flow flow = classify(opcode);
+        if(flow != FLOW_NEXT && flow != FLOW_STORE) {
+            terminated = true;
+            break;
+        }
+        if(flow == FLOW_STORE)
+            break;
+    }
+    if(!terminated)
+        fprintf(out, "    c->PC = 0x%04X;\n", addr);
+    fprintf(out, "}\n\n");
+    return addr;
+}
+
+int main(int argc, const char** argv)
+{
+    if(argc < 2) {
+        fprintf(stderr, "USAGE: %s <path to rom> [output.c]\n", argv[0]);
+        return 69;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(in == NULL) {
+        fprintf(stderr, "ROM file %s is invalid or not exist\n", argv[1]);
+        return 69;
+    }
+    size_t rom_size = fread(&rom[CHIP8_ROM_B], 1, CHIP8_RAM_CAPACITY - CHIP8_ROM_B + 1, in);
+    fclose(in);
+    if(rom_size == 0 || rom_size > CHIP8_RAM_CAPACITY - CHIP8_ROM_B) {
+        fprintf(stderr, "ROM file %s is empty or too big\n", argv[1]);
+        return 69;
+    }
+    rom_end = CHIP8_ROM_B + rom_size;
+
+    FILE* out = stdout;
+    if(argc > 2) {
+        out = fopen(argv[2], "w");
+        if(out == NULL) {
+            fprintf(stderr, "Could not open %s for writing\n", argv[2]);
+            return 69;
+        }
+    }
+
+    build_cfg();
+
+    fprintf(out, "// Generated by chip8-aot from %s, do not edit.\n", argv[1]);
+    fprintf(out, "#include \"chip8.h\"\n\n#include <string.h>\n\n");
+
+    static uint16_t block_end[CHIP8_RAM_CAPACITY];
+    static uint8_t block_length[CHIP8_RAM_CAPACITY];
+    uint32_t block_count = 0;
+    for(uint32_t addr = CHIP8_ROM_B; addr < rom_end; ++addr) {
+        if(leader[addr] && visited[addr]) {
+            block_end[addr] = emit_block(out, addr, &block_length[addr]);
+            block_count++;
+        }
+    }
+
+    // Blocks that sit inside one 64 byte word of Chip8.written are checked
+    // for stores with a single AND, the rest go through chip8_ram_written
+    fprintf(out, "typedef struct {\n"
+            "    void (*run)(Chip8* c);\n"
+            "    uint16_t end; // address past the last instruction\n"
+            "    uint8_t length; // instructions retired by one run\n"
+            "    uint8_t word; // index into Chip8.written when mask != 0\n"
+            "    uint64_t mask;\n"
+            "} Aot_Block;\n\n");
+    fprintf(out, "static const Aot_Block aot_blocks[CHIP8_RAM_CAPACITY] = {\n");
+    for(uint32_t addr = CHIP8_ROM_B; addr < rom_end; ++addr) {
+        if(leader[addr] && visited[addr]) {
+            uint32_t last = block_end[addr] - 1;
+            uint64_t mask = 0;
+            if(addr / 64 == last / 64)
+                mask = (~0ull << (addr % 64)) & (~0ull >> (63 - last % 64));
+            fprintf(out, "    [0x%04X] = { block_%04X, 0x%04X, %u, %u, 0x%016llXull },\n",
+                    addr, addr, block_end[addr], block_length[addr], addr / 64,
+                    (unsigned long long)mask);
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const uint8_t aot_rom[%zu] = {", rom_size);
+    for(size_t i = 0; i < rom_size; ++i)
+        fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n    " : " ", rom[CHIP8_ROM_B + i]);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out,
+            "bool chip8_aot_matches(const Chip8* c)\n"
+            "{\n"
+            "    return memcmp(&c->ram[CHIP8_ROM_B], aot_rom, sizeof(aot_rom)) == 0;\n"
+            "}\n\n"
+            "uint64_t chip8_run_aot(Chip8* c, uint64_t count)\n"
+            "{\n"
+            "    uint64_t executed = 0;\n"
+            "    while(executed < count && !c->waiting) {\n"
+            "        uint16_t pc = c->PC;\n"
+            "        const Aot_Block* b = pc < CHIP8_RAM_CAPACITY ? &aot_blocks[pc] : NULL;\n"
+            "        if(b == NULL || b->run == NULL || b->length > count - executed\n"
+            "                || (b->mask != 0 ? (c->written[b->word] & b->mask) != 0\n"
+            "                                 : chip8_ram_written(c, pc, b->end))) {\n"
+            "            chip8_emulate_instruction(c);\n"
+            "            executed++;\n"
+            "            continue;\n"
+            "        }\n"
+            "        b->run(c);\n"
+            "        executed += b->length;\n"
+            "    }\n"
+            "    return executed;\n"
+            "}\n");
+
+    if(out != stdout)
+        fclose(out);
+    fprintf(stderr, "%u blocks translated\n", block_count);
+    return 0;
+}
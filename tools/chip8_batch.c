@@ -0,0 +1,432 @@
+// chip8-batch: run a corpus of ROMs headless on every core.
+//
+//     chip8-batch [options] <directory | manifest>
+//
+//     --frames <n>    run every ROM for n 60hz frames (default 600)
+//     --cycles <n>    run every ROM for n instructions instead
+//     --hz <n>        CPU clock used to size a frame (default 700)
+//     -j <n>          number of worker threads (default: one per core)
+//     --summary <f>   also write "<rom> <hash> <cycles>" lines to f
+//
+// A manifest is a text file with one ROM path per line, relative to the
+// manifest itself. Blank lines and lines starting with # are ignored. A
+// directory is scanned for *.ch8 files and *.c8r replays.
+//
+// A replay (see chip8_replay.c) brings its own ROM, seed, clock and length,
+// --frames, --cycles and --hz do not apply to it. It fails when the final
+// state differs from the one recorded, which makes a directory of replays a
+// regression suite.
+//
+// Each ROM gets one line with its final framebuffer hash, cycle count and
+// wall time. The summary leaves the timing out and is sorted by name so the
+// file from two builds can be diffed directly. Every instance uses the same
+// fixed RNG seed, so results only change when emulation does.
+//
+// Jobs are dealt out to the workers in contiguous chunks. A worker takes its
+// own jobs from the back of its chunk and, once it runs dry, steals from the
+// front of the others, so a few slow ROMs do not leave the other cores idle.
+#include "chip8.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#define BATCH_DEFAULT_FRAMES 600
+#define BATCH_MAX_WORKERS 256
+
+typedef struct {
+    char* path;
+    const char* name; // path relative to the corpus, used in the output
+    bool ok;
+    uint64_t hash;
+    uint64_t cycles;
+    double seconds;
+} Job;
+
+// Range of jobs [head, tail) still owned by one worker, packed into one word
+// so the owner and thieves can both claim from it with a single CAS
+typedef struct {
+    _Atomic uint64_t range;
+} Queue;
+
+static Job* jobs;
+static uint32_t job_count, job_capacity;
+static Queue queues[BATCH_MAX_WORKERS];
+static uint32_t worker_count;
+static uint64_t frames = BATCH_DEFAULT_FRAMES, cycles, instructions_per_frame;
+
+static double get_time_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint32_t core_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t)n : 1;
+#endif
+}
+
+static void add_job(const char* dir, const char* name)
+{
+    if(job_count == job_capacity) {
+        job_capacity = job_capacity ? job_capacity * 2 : 64;
+        jobs = realloc(jobs, job_capacity * sizeof(*jobs));
+        if(jobs == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(69);
+        }
+    }
+    size_t dir_length = strlen(dir);
+    Job* job = &jobs[job_count++];
+    memset(job, 0, sizeof(*job));
+    job->path = malloc(dir_length + strlen(name) + 2);
+    if(job->path == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(69);
+    }
+    if(dir_length > 0) {
+        sprintf(job->path, "%s/%s", dir, name);
+        job->name = job->path + dir_length + 1;
+    } else {
+        strcpy(job->path, name);
+        job->name = job->path;
+    }
+}
+
+static bool has_extension(const char* name, const char* extension)
+{
+    size_t length = strlen(name), extension_length = strlen(extension);
+    return length > extension_length && strcmp(name + length - extension_length, extension) == 0;
+}
+
+static bool is_job_file(const char* name)
+{
+    return has_extension(name, ".ch8") || has_extension(name, ".c8r");
+}
+
+static bool scan_directory(const char* dir)
+{
+#ifdef _WIN32
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA(pattern, &entry);
+    if(find == INVALID_HANDLE_VALUE) {
+        return GetLastError() == ERROR_FILE_NOT_FOUND;
+    }
+    do {
+        if(is_job_file(entry.cFileName)) {
+            add_job(dir, entry.cFileName);
+        }
+    } while(FindNextFileA(find, &entry));
+    FindClose(find);
+    return true;
+#else
+    DIR* d = opendir(dir);
+    if(d == NULL) {
+        return false;
+    }
+    struct dirent* entry;
+    while((entry = readdir(d)) != NULL) {
+        if(is_job_file(entry->d_name)) {
+            add_job(dir, entry->d_name);
+        }
+    }
+    closedir(d);
+    return true;
+#endif
+}
+
+static bool read_manifest(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        return false;
+    }
+
+    // ROM paths are relative to the directory holding the manifest
+    char dir[1024] = "";
+    const char* slash = strrchr(path, '/');
+#ifdef _WIN32
+    const char* backslash = strrchr(path, '\\');
+    if(backslash > slash) slash = backslash;
+#endif
+    if(slash != NULL) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+
+    char line[1024];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        add_job(dir, line);
+    }
+    fclose(f);
+    return true;
+}
+
+static int compare_jobs(const void* a, const void* b)
+{
+    return strcmp(((const Job*)a)->name, ((const Job*)b)->name);
+}
+
+static int64_t queue_take(Queue* q, bool steal)
+{
+    uint64_t range = atomic_load(&q->range);
+    for(;;) {
+        uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+        if(head >= tail) {
+            return -1;
+        }
+        // The owner works from the back, thieves from the front
+        uint64_t next = steal
+            ? ((uint64_t)tail << 32) | (head + 1)
+            : ((uint64_t)(tail - 1) << 32) | head;
+        if(atomic_compare_exchange_weak(&q->range, &range, next)) {
+            return steal ? head : tail - 1;
+        }
+    }
+}
+
+static void batch_log(void* user, Chip8_Log_Level level, const char* message)
+{
+    const Job* job = user;
+    if(level >= CHIP8_LOG_WARNING) {
+        fprintf(stderr, "%s: %s", job->name, message);
+    }
+}
+
+// Plays a replay to its end and checks the final state against it
+static bool run_replay(Chip8* c, Job* job)
+{
+    Chip8_Replay replay;
+    if(!chip8_replay_load(c, &replay, job->path)) {
+        return false;
+    }
+    if(!chip8_replay_play(c, &replay)) {
+        chip8_replay_free(&replay);
+        return false;
+    }
+#ifdef CHIP8_JIT
+    chip8_jit_init(c);
+#endif
+    while(c->cycles < replay.cycles) {
+        uint64_t step = replay.cycles - c->cycles;
+        if(step > replay.instructions_per_frame) step = replay.instructions_per_frame;
+        chip8_run_frame(c, step);
+    }
+    job->cycles = c->cycles;
+
+    const bool same = chip8_replay_hash(c) == replay.state_hash;
+    if(!same) {
+        chip8_log(c, CHIP8_LOG_ERROR, "Final state differs from the recording\n");
+    }
+    c->replay = NULL;
+    chip8_replay_free(&replay);
+    return same;
+}
+
+static void run_job(Chip8* c, Job* job)
+{
+    // No random callback, CXNN draws from the generator of the instance which
+    // always starts from CHIP8_DEFAULT_SEED
+    const Chip8_Host host = {
+        .user = job,
+        .log = batch_log,
+    };
+
+    double start = get_time_seconds();
+    if(!chip8_init(c, &host)) {
+        return;
+    }
+    if(has_extension(job->path, ".c8r")) {
+        job->ok = run_replay(c, job);
+        job->hash = chip8_display_hash(c);
+        job->seconds = get_time_seconds() - start;
+        chip8_deinit(c);
+        return;
+    }
+    if(!chip8_load_rom_file(c, job->path)) {
+        chip8_deinit(c);
+        return;
+    }
+#ifdef CHIP8_JIT
+    chip8_jit_init(c);
+#endif
+
+    // Nothing presses a key here, once a ROM is blocked in FX0A with its
+    // timers run out the rest of its frames would all be the same. The job
+    // counts them and hands its worker to the next one.
+    if(cycles > 0) {
+        // Still in frame sized steps so the timers keep their meaning
+        while(job->cycles < cycles && !chip8_blocked(c)) {
+            uint64_t step = cycles - job->cycles;
+            if(step > instructions_per_frame) step = instructions_per_frame;
+            job->cycles += chip8_run_frame(c, step);
+        }
+        job->cycles = cycles;
+    } else {
+        uint64_t f = 0;
+        for(; f < frames && !chip8_blocked(c); f++) {
+            job->cycles += chip8_run_frame(c, instructions_per_frame);
+        }
+        job->cycles += (frames - f) * instructions_per_frame;
+    }
+
+    job->hash = chip8_display_hash(c);
+    job->seconds = get_time_seconds() - start;
+    job->ok = true;
+    chip8_deinit(c);
+}
+
+static int worker(void* arg)
+{
+    const uint32_t id = (uint32_t)(uintptr_t)arg;
+    Chip8* c = malloc(sizeof(*c));
+    if(c == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for(;;) {
+        int64_t job = queue_take(&queues[id], false);
+        for(uint32_t i = 1; job < 0 && i < worker_count; i++) {
+            job = queue_take(&queues[(id + i) % worker_count], true);
+        }
+        // No job is ever added after the start, empty everywhere means done
+        if(job < 0) {
+            break;
+        }
+        run_job(c, &jobs[job]);
+    }
+
+    free(c);
+    return 0;
+}
+
+int main(int argc, const char** argv)
+{
+    const char* corpus = NULL;
+    const char* summary_path = NULL;
+    uint64_t hz = CHIP8_DEFAULT_CPU_HZ;
+    worker_count = core_count();
+
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycles = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+            hz = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            worker_count = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summary_path = argv[++i];
+        } else if(corpus == NULL && argv[i][0] != '-') {
+            corpus = argv[i];
+        } else {
+            corpus = NULL;
+            break;
+        }
+    }
+    if(corpus == NULL) {
+        fprintf(stderr, "USAGE: %s [--frames <n> | --cycles <n>] [--hz <n>] [-j <threads>] "
+                "[--summary <file>] <directory | manifest>\n", argv[0]);
+        return 69;
+    }
+    instructions_per_frame = hz < CHIP8_FRAME_RATE ? 1 : hz / CHIP8_FRAME_RATE;
+
+    if(!scan_directory(corpus) && !read_manifest(corpus)) {
+        fprintf(stderr, "%s is neither a directory nor a readable manifest\n", corpus);
+        return 69;
+    }
+    if(job_count == 0) {
+        fprintf(stderr, "No ROMs found in %s\n", corpus);
+        return 69;
+    }
+    qsort(jobs, job_count, sizeof(*jobs), compare_jobs);
+
+    if(worker_count < 1) worker_count = 1;
+    if(worker_count > BATCH_MAX_WORKERS) worker_count = BATCH_MAX_WORKERS;
+    if(worker_count > job_count) worker_count = job_count;
+
+    for(uint32_t w = 0; w < worker_count; w++) {
+        uint64_t head = (uint64_t)job_count * w / worker_count;
+        uint64_t tail = (uint64_t)job_count * (w + 1) / worker_count;
+        atomic_init(&queues[w].range, (tail << 32) | head);
+    }
+
+    double start = get_time_seconds();
+    thrd_t threads[BATCH_MAX_WORKERS];
+    uint32_t started = 0;
+    for(; started < worker_count; started++) {
+        if(thrd_create(&threads[started], worker, (void*)(uintptr_t)started) != thrd_success) {
+            fprintf(stderr, "Failed to start worker %u, continuing with %u\n", started, started);
+            break;
+        }
+    }
+    if(started == 0) {
+        // Nobody to steal the jobs, run them all here
+        worker((void*)0);
+    }
+    for(uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+    double elapsed = get_time_seconds() - start;
+
+    FILE* summary = NULL;
+    if(summary_path != NULL) {
+        summary = fopen(summary_path, "w");
+        if(summary == NULL) {
+            fprintf(stderr, "Could not open %s for writing\n", summary_path);
+        }
+    }
+
+    uint64_t total_cycles = 0;
+    uint32_t failed = 0;
+    for(uint32_t i = 0; i < job_count; i++) {
+        const Job* job = &jobs[i];
+        if(!job->ok) {
+            printf("FAILED           %12s %10s  %s\n", "-", "-", job->name);
+            if(summary) fprintf(summary, "%s FAILED\n", job->name);
+            failed++;
+            continue;
+        }
+        printf("%016llx %12llu %8.2fms  %s\n", (unsigned long long)job->hash,
+                (unsigned long long)job->cycles, job->seconds * 1e3, job->name);
+        if(summary) fprintf(summary, "%s %016llx %llu\n", job->name,
+                (unsigned long long)job->hash, (unsigned long long)job->cycles);
+        total_cycles += job->cycles;
+    }
+    if(summary) fclose(summary);
+
+    printf("%u ROMs (%u failed) on %u threads, %llu instructions in %.3fs, %.2f MIPS\n",
+            job_count, failed, started ? started : 1, (unsigned long long)total_cycles,
+            elapsed, (double)total_cycles / elapsed / 1e6);
+
+    for(uint32_t i = 0; i < job_count; i++) {
+        free(jobs[i].path);
+    }
+    free(jobs);
+    return failed ? 1 : 0;
+}
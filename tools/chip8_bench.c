@@ -0,0 +1,411 @@
+// chip8-bench: time the interpreter on synthetic opcode mixes.
+//
+//     chip8-bench [options]
+//
+//     --instructions <n>  instructions per run (default 50000000)
+//     --repeat <n>        runs per ROM, the fastest one is reported (default 5)
+//     --ipf <n>           instructions per frame (default 1000)
+//     --only <name>       run a single ROM
+//     --output <file>     write the JSON report to file instead of stdout
+//     --write <dir>       write the ROMs as <dir>/bench_<name>.ch8 and exit
+//
+// Every ROM is a tight endless loop built around one kind of instruction and
+// is generated here, so the numbers do not depend on files lying around. The
+// ROMs run headless through chip8_run_frame with whatever engine the build
+// selected (THREADED=1, JIT=1, PROFILE=1), so two builds, or two commits,
+// can be compared by diffing their reports.
+//
+// Frames are much longer than at the default clock to keep the per frame
+// work (timers, input) out of the instruction cost. The report gives the
+// engine, then per ROM the instructions per second and ns per instruction of
+// the fastest run, how many of the instructions chip8_run_frame skipped
+// (idle loops, FX0A) rather than ran, and how many heap allocations the core
+// made while setting up and while running, as counted by chip8_allocations.
+// The code buffer the JIT maps is not a heap allocation and is not counted.
+#include "chip8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_INSTRUCTIONS 50000000ull
+#define BENCH_DEFAULT_REPEAT 5
+#define BENCH_DEFAULT_IPF 1000
+#define BENCH_MAX_ROM 256
+
+typedef struct {
+    uint8_t bytes[BENCH_MAX_ROM];
+    size_t size;
+} Rom;
+
+typedef struct {
+    const char* name;
+    const char* description;
+    void (*build)(Rom* rom);
+} Bench;
+
+typedef struct {
+    double seconds;
+    uint64_t instructions;
+    uint64_t skipped; // of instructions, counted by chip8_run_frame without running
+    uint64_t setup_allocations, allocations, allocated_bytes;
+    uint64_t state_hash;
+} Result;
+
+static void emit(Rom* rom, uint16_t opcode)
+{
+    rom->bytes[rom->size++] = (uint8_t)(opcode >> 8);
+    rom->bytes[rom->size++] = (uint8_t)opcode;
+}
+
+// Address of the next instruction emitted
+static uint16_t here(const Rom* rom)
+{
+    return (uint16_t)(CHIP8_ROM_B + rom->size);
+}
+
+static void build_alu(Rom* rom)
+{
+    static const uint16_t setup[] = { 0x6001, 0x6103, 0x6207, 0x630F, 0x6455, 0x65AA, 0x66F0, 0x670C };
+    for(size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) emit(rom, setup[i]);
+
+    // Every 8XYN, the ones that set VF included, on registers that keep
+    // changing so nothing settles into a constant
+    const uint16_t loop = here(rom);
+    static const uint16_t body[] = {
+        0x8014, 0x8125, 0x8236, 0x8347, 0x845E, 0x8561, 0x8672, 0x8783,
+        0x8010, 0x8124, 0x8235, 0x8307, 0x8416, 0x854E, 0x8651, 0x8702,
+    };
+    for(size_t i = 0; i < sizeof(body) / sizeof(body[0]); i++) emit(rom, body[i]);
+    emit(rom, 0x7001);
+    emit(rom, 0x1000 | loop);
+}
+
+static void build_draw(Rom* rom)
+{
+    static const uint16_t setup[] = { 0x6000, 0x6100, 0x6210, 0x6308, 0x6428, 0x6510, 0x6607, 0xF629 };
+    for(size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) emit(rom, setup[i]);
+
+    // Font glyphs at moving, partly wrapping positions, so both the aligned
+    // and the straddling paths of the blitter and the collision flag get work
+    const uint16_t loop = here(rom);
+    static const uint16_t body[] = {
+        0xD015, 0xD235, 0xD455, 0xD105, 0xD325, 0xD545,
+        0x7003, 0x7101, 0x7205, 0x7302, 0x7407, 0x7503,
+    };
+    for(size_t i = 0; i < sizeof(body) / sizeof(body[0]); i++) emit(rom, body[i]);
+    emit(rom, 0x1000 | loop);
+}
+
+static void build_call(Rom* rom)
+{
+    // main calls a chain of four subroutines, each calling the next
+    const uint16_t loop = here(rom);
+    const uint16_t first = (uint16_t)(loop + 6);
+    emit(rom, 0x2000 | first);
+    emit(rom, 0x7001);
+    emit(rom, 0x1000 | loop);
+    for(int depth = 0; depth < 4; depth++) {
+        if(depth < 3) emit(rom, (uint16_t)(0x2000 | (here(rom) + 6)));
+        emit(rom, (uint16_t)(0x7101 + (depth << 8)));
+        emit(rom, 0x00EE);
+    }
+}
+
+static void build_skip(Rom* rom)
+{
+    static const uint16_t setup[] = { 0x6000, 0x6105, 0x6205, 0x6303 };
+    for(size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) emit(rom, setup[i]);
+
+    // Every conditional skip, taken and not taken, each guarding an add so a
+    // wrongly taken branch shows in the registers
+    const uint16_t loop = here(rom);
+    static const uint16_t body[] = {
+        0x3000, 0x7A01, // rarely taken, V0 counts up
+        0x4000, 0x7B01, // mostly taken
+        0x5120, 0x7C01, // taken, V2 catches up with V1 below
+        0x9130, 0x7D01, // mostly taken
+        0x3105, 0x7E01, // rarely taken
+        0x4303, 0x7101, // not taken
+        0xE09E, 0x7201, // no key is down, not taken
+        0xE0A1, 0x7201, // taken
+        0x8210, 0x7001,
+    };
+    for(size_t i = 0; i < sizeof(body) / sizeof(body[0]); i++) emit(rom, body[i]);
+    emit(rom, 0x1000 | loop);
+}
+
+static void build_memory(Rom* rom)
+{
+    static const uint16_t setup[] = { 0x6001, 0x6102, 0x6203, 0x6304, 0x6405, 0x6506, 0x6607, 0x6708 };
+    for(size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) emit(rom, setup[i]);
+
+    // Register dumps and loads of every length, well away from the code so
+    // no write invalidates a decoded instruction
+    const uint16_t loop = here(rom);
+    static const uint16_t body[] = {
+        0xA600, 0xF755, 0xFF65, 0xA610, 0xFF55, 0xF765,
+        0xA620, 0xF355, 0xF065, 0xFB55, 0xF565, 0x7001,
+    };
+    for(size_t i = 0; i < sizeof(body) / sizeof(body[0]); i++) emit(rom, body[i]);
+    emit(rom, 0x1000 | loop);
+}
+
+static void build_pairs(Rom* rom)
+{
+    static const uint16_t setup[] = { 0x6000, 0x6100, 0x6200, 0x6F00 };
+    for(size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) emit(rom, setup[i]);
+
+    // The loops of a typical game, made of the pairs chip8_run_switch fuses:
+    // a counter stepping up to a limit, a table lookup, coordinates and a
+    // sprite drawn and erased again
+    const uint16_t table = (uint16_t)(here(rom) + 2);
+    emit(rom, (uint16_t)(0x1000 | (table + 16)));
+    static const uint8_t data[16] = { 3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 9, 7, 9, 3 };
+    for(size_t i = 0; i < sizeof(data); i += 2) emit(rom, (uint16_t)((data[i] << 8) | data[i+1]));
+
+    const uint16_t loop = here(rom);
+    const uint16_t body[] = {
+        0x7201, 0x3210, (uint16_t)(0x1000 | (loop + 8)), 0x6200, // V2 counts 0..15
+        (uint16_t)(0xA000 | table), 0xF21E, 0xF065, 0x8304, // V3 += table[V2]
+        0x6408, 0x6504, (uint16_t)(0xA000 | table), 0xD451, 0xD451, // draw and erase
+        0x7101,
+    };
+    for(size_t i = 0; i < sizeof(body) / sizeof(body[0]); i++) emit(rom, body[i]);
+    emit(rom, 0x1000 | loop);
+}
+
+static void build_wait(Rom* rom)
+{
+    // A game paced by the delay timer: set it, poll it down to zero, draw.
+    // chip8_run_frame skips the polling, see chip8_skip_idle.
+    const uint16_t loop = here(rom);
+    emit(rom, 0x6005);
+    emit(rom, 0xF015);
+    const uint16_t wait = here(rom);
+    emit(rom, 0xF107);
+    emit(rom, 0x3100);
+    emit(rom, 0x1000 | wait);
+    emit(rom, 0xA000);
+    emit(rom, 0xD235);
+    emit(rom, 0x7201);
+    emit(rom, 0x1000 | loop);
+}
+
+static const Bench benches[] = {
+    { "alu",    "8XYN arithmetic and logic",          build_alu },
+    { "draw",   "DXYN sprites",                       build_draw },
+    { "call",   "2NNN/00EE chains four deep",         build_call },
+    { "skip",   "3XNN/4XNN/5XY0/9XY0/EX9E/EXA1 skips", build_skip },
+    { "memory", "FX55/FX65 register dumps and loads", build_memory },
+    { "pairs",  "loops made of the fused opcode pairs", build_pairs },
+    { "wait",   "FX07/3X00/1NNN delay timer polls",   build_wait },
+};
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+static const char* engine_name(void)
+{
+#if defined(CHIP8_PROFILE)
+    return "switch (profile)";
+#elif defined(CHIP8_JIT)
+    return "jit";
+#elif defined(CHIP8_THREADED_DISPATCH)
+    return "threaded";
+#else
+    return "switch";
+#endif
+}
+
+static double get_time_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void bench_log(void* user, Chip8_Log_Level level, const char* message)
+{
+    const Bench* bench = user;
+    if(level >= CHIP8_LOG_WARNING) {
+        fprintf(stderr, "%s: %s", bench->name, message);
+    }
+}
+
+static bool run_once(Chip8* c, const Bench* bench, const Rom* rom, uint64_t count, uint64_t ipf,
+        Result* result)
+{
+    const Chip8_Host host = {
+        .user = (void*)bench,
+        .log = bench_log,
+    };
+
+    uint64_t before_setup, bytes_before_setup;
+    chip8_allocations(&before_setup, &bytes_before_setup);
+    if(!chip8_init(c, &host) || !chip8_load_rom(c, rom->bytes, rom->size)) {
+        return false;
+    }
+#ifdef CHIP8_JIT
+    chip8_jit_init(c);
+#endif
+
+    uint64_t before_run, bytes_before_run;
+    chip8_allocations(&before_run, &bytes_before_run);
+    result->setup_allocations = before_run - before_setup;
+    const double start = get_time_seconds();
+    uint64_t executed = 0;
+    while(executed < count) {
+        const uint64_t step = count - executed < ipf ? count - executed : ipf;
+        executed += chip8_run_frame(c, step);
+    }
+    result->seconds = get_time_seconds() - start;
+    uint64_t after_run, bytes_after_run;
+    chip8_allocations(&after_run, &bytes_after_run);
+    result->allocations = after_run - before_run;
+    result->allocated_bytes = bytes_after_run - bytes_before_run;
+    result->instructions = executed;
+    result->skipped = c->skipped;
+    result->state_hash = chip8_replay_hash(c);
+    chip8_deinit(c);
+    return true;
+}
+
+static bool write_roms(const char* dir)
+{
+    for(size_t i = 0; i < BENCH_COUNT; i++) {
+        Rom rom = {0};
+        benches[i].build(&rom);
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/bench_%s.ch8", dir, benches[i].name);
+        FILE* f = fopen(path, "wb");
+        if(f == NULL) {
+            fprintf(stderr, "Could not open %s for writing\n", path);
+            return false;
+        }
+        const bool ok = fwrite(rom.bytes, 1, rom.size, f) == rom.size;
+        if(fclose(f) != 0 || !ok) {
+            fprintf(stderr, "Failed to write %s\n", path);
+            return false;
+        }
+        printf("%s\n", path);
+    }
+    return true;
+}
+
+int main(int argc, const char** argv)
+{
+    uint64_t count = BENCH_DEFAULT_INSTRUCTIONS, repeat = BENCH_DEFAULT_REPEAT, ipf = BENCH_DEFAULT_IPF;
+    const char* only = NULL;
+    const char* output_path = NULL;
+    const char* write_dir = NULL;
+    bool usage = false;
+
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--instructions") == 0 && i + 1 < argc) {
+            count = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            ipf = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if(strcmp(argv[i], "--write") == 0 && i + 1 < argc) {
+            write_dir = argv[++i];
+        } else {
+            usage = true;
+        }
+    }
+    if(usage || count == 0 || repeat == 0 || ipf == 0) {
+        fprintf(stderr, "USAGE: %s [--instructions <n>] [--repeat <n>] [--ipf <n>] [--only <name>] "
+                "[--output <file>] [--write <dir>]\n", argv[0]);
+        return 69;
+    }
+    if(write_dir != NULL) {
+        return write_roms(write_dir) ? 0 : 69;
+    }
+
+    bool found = only == NULL;
+    for(size_t i = 0; i < BENCH_COUNT; i++) {
+        if(only != NULL && strcmp(only, benches[i].name) == 0) found = true;
+    }
+    if(!found) {
+        fprintf(stderr, "No benchmark named %s, there are:", only);
+        for(size_t i = 0; i < BENCH_COUNT; i++) fprintf(stderr, " %s", benches[i].name);
+        fprintf(stderr, "\n");
+        return 69;
+    }
+
+    Chip8* c = malloc(sizeof(*c));
+    if(c == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 69;
+    }
+
+    Result results[BENCH_COUNT] = {0};
+    bool ok = true;
+    for(size_t i = 0; ok && i < BENCH_COUNT; i++) {
+        if(only != NULL && strcmp(only, benches[i].name) != 0) continue;
+        Rom rom = {0};
+        benches[i].build(&rom);
+        for(uint64_t r = 0; ok && r < repeat; r++) {
+            Result run = {0};
+            ok = run_once(c, &benches[i], &rom, count, ipf, &run);
+            if(r == 0 || run.seconds < results[i].seconds) results[i] = run;
+        }
+        if(ok) {
+            fprintf(stderr, "%-8s %8.2f ns/op\n", benches[i].name,
+                    results[i].seconds * 1e9 / (double)results[i].instructions);
+        }
+    }
+    free(c);
+    if(!ok) {
+        return 69;
+    }
+
+    FILE* out = stdout;
+    if(output_path != NULL) {
+        out = fopen(output_path, "w");
+        if(out == NULL) {
+            fprintf(stderr, "Could not open %s for writing\n", output_path);
+            return 69;
+        }
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"engine\": \"%s\",\n", engine_name());
+#ifdef NDEBUG
+    fprintf(out, "  \"debug\": false,\n");
+#else
+    fprintf(out, "  \"debug\": true,\n");
+#endif
+    fprintf(out, "  \"instructions\": %llu,\n", (unsigned long long)count);
+    fprintf(out, "  \"repeat\": %llu,\n", (unsigned long long)repeat);
+    fprintf(out, "  \"instructions_per_frame\": %llu,\n", (unsigned long long)ipf);
+    fprintf(out, "  \"results\": [");
+    const char* separator = "\n";
+    for(size_t i = 0; i < BENCH_COUNT; i++) {
+        if(only != NULL && strcmp(only, benches[i].name) != 0) continue;
+        const Result* r = &results[i];
+        fprintf(out, "%s    {\n", separator);
+        fprintf(out, "      \"name\": \"%s\",\n", benches[i].name);
+        fprintf(out, "      \"description\": \"%s\",\n", benches[i].description);
+        fprintf(out, "      \"instructions\": %llu,\n", (unsigned long long)r->instructions);
+        fprintf(out, "      \"skipped\": %llu,\n", (unsigned long long)r->skipped);
+        fprintf(out, "      \"seconds\": %.6f,\n", r->seconds);
+        fprintf(out, "      \"instructions_per_second\": %.0f,\n", (double)r->instructions / r->seconds);
+        fprintf(out, "      \"ns_per_op\": %.3f,\n", r->seconds * 1e9 / (double)r->instructions);
+        fprintf(out, "      \"setup_allocations\": %llu,\n", (unsigned long long)r->setup_allocations);
+        fprintf(out, "      \"allocations\": %llu,\n", (unsigned long long)r->allocations);
+        fprintf(out, "      \"allocated_bytes\": %llu,\n", (unsigned long long)r->allocated_bytes);
+        fprintf(out, "      \"state_hash\": \"%016llx\"\n", (unsigned long long)r->state_hash);
+        fprintf(out, "    }");
+        separator = ",\n";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if(out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s\n", output_path);
+        return 69;
+    }
+    return 0;
+}
@@ -0,0 +1,690 @@
+// chip8-conform: run test ROMs headless and compare their screens to goldens.
+//
+//     chip8-conform [options] <goldens>
+//
+//     -j <n>          number of worker threads (default: one per core)
+//     --keep-going    run every ROM even after one failed
+//     --update        store the current hashes in the goldens file instead
+//
+// The goldens file has one ROM per line, relative to the goldens file:
+//
+//     <display hash | -> <max frames> <rom>
+//
+// Blank lines and lines starting with # are ignored. builtin:selfcheck,
+// builtin:idle and builtin:keywait are the ROMs generated below instead of
+// files. Community test suites (corax+, flags, quirks, ...) are added by
+// appending their paths with - as the hash, running --update and checking the
+// screens they draw by eye once.
+//
+// Every ROM runs at the default clock with no key pressed, builtins may press
+// keys from a script of their own, until its display
+// has not changed for CONFORM_QUIET_FRAMES frames, or for at most its
+// max frames, and the hash of the display it ends on must match the golden.
+// The reference is the portable switch interpreter. Every other engine the
+// build has (THREADED=1, JIT=1 and the lockstep SoA engine) runs the same
+// ROM next to it and its whole state must match the reference after every
+// frame, so an optimized engine fails on the frame it first goes wrong even
+// if the screen comes out right. So does chip8_run_frame itself, whose idle
+// loop skipping leaves no trace in the state: builtin:idle also fails when a
+// frame that starts inside its poll loop did not skip.
+//
+// The first failure stops every worker unless --keep-going is given. The
+// exit code is 0 when every ROM passed and 1 otherwise.
+#include "chip8.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define CONFORM_QUIET_FRAMES 60
+#define CONFORM_MAX_WORKERS 256
+#define CONFORM_SOA_LANES 3
+#define CONFORM_INSTRUCTIONS_PER_FRAME (CHIP8_DEFAULT_CPU_HZ / CHIP8_FRAME_RATE)
+#define CONFORM_BUILTIN_PREFIX "builtin:"
+
+typedef enum {
+    ENTRY_PENDING = 0,
+    ENTRY_PASSED,
+    ENTRY_FAILED,
+} Entry_Status;
+
+typedef struct {
+    size_t line; // index into lines, rewritten by --update
+    char* path;
+    const char* name; // as written in the goldens file
+    bool has_golden;
+    uint64_t golden;
+    uint64_t max_frames;
+
+    Entry_Status status;
+    uint64_t hash;
+    uint64_t frames;
+    bool quiet;
+    char reason[160];
+} Entry;
+
+typedef struct {
+    uint8_t bytes[CHIP8_RAM_CAPACITY - CHIP8_ROM_B];
+    size_t size;
+} Rom;
+
+typedef struct {
+    const char* name;
+    void (*build)(Rom* rom);
+    // When true at the start of a frame chip8_run_frame has to skip
+    // instructions in it, NULL if the ROM does not care
+    bool (*must_skip)(const Chip8* c);
+    // Keys down in a frame, bit n for key n, NULL for none
+    uint16_t (*keys)(uint64_t frame);
+} Builtin;
+
+static char** lines;
+static size_t line_count, line_capacity;
+static Entry* entries;
+static size_t entry_count, entry_capacity;
+static _Atomic size_t next_entry;
+static atomic_bool stop;
+static bool keep_going, update;
+
+static uint32_t core_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t)n : 1;
+#endif
+}
+
+static void* grow(void* array, size_t* capacity, size_t size)
+{
+    *capacity = *capacity ? *capacity * 2 : 64;
+    array = realloc(array, *capacity * size);
+    if(array == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(69);
+    }
+    return array;
+}
+
+static void emit(Rom* rom, uint16_t opcode)
+{
+    rom->bytes[rom->size++] = (uint8_t)(opcode >> 8);
+    rom->bytes[rom->size++] = (uint8_t)opcode;
+}
+
+static uint16_t here(const Rom* rom)
+{
+    return (uint16_t)(CHIP8_ROM_B + rom->size);
+}
+
+// One 8XYN with VA = a and VB = b, VE counts every result or flag that is
+// not the expected one. x and y pick VA, VB or VF.
+static void emit_alu_case(Rom* rom, uint8_t n, uint8_t x, uint8_t y, uint8_t a, uint8_t b,
+        uint8_t result, uint8_t flag)
+{
+    emit(rom, (uint16_t)(0x6000 | (x << 8) | a));
+    if(y != x) emit(rom, (uint16_t)(0x6000 | (y << 8) | b));
+    emit(rom, (uint16_t)(0x8000 | (x << 8) | (y << 4) | n));
+    if(x != 0xF) {
+        emit(rom, (uint16_t)(0x3000 | (x << 8) | result));
+        emit(rom, 0x7E01);
+    }
+    emit(rom, (uint16_t)(0x3F00 | flag));
+    emit(rom, 0x7E01);
+}
+
+// Checks the arithmetic flags, every skip and calls down to half the stack
+// depth, then draws the number of failed checks as three decimal digits.
+// A passing run shows 000.
+static void build_selfcheck(Rom* rom)
+{
+    emit(rom, 0x1000); // jumps over the subroutines, patched below
+    const uint16_t once = here(rom);
+    emit(rom, 0x7D01);
+    emit(rom, 0x00EE);
+    // Recurses until VD reaches the depth, then unwinds
+    const uint16_t deep = here(rom);
+    emit(rom, 0x7D01);
+    emit(rom, (uint16_t)(0x3D00 | CHIP8_STACK_DEPTH / 2));
+    emit(rom, 0x2000 | deep);
+    emit(rom, 0x00EE);
+    const uint16_t main = here(rom);
+    rom->bytes[0] = (uint8_t)(0x10 | (main >> 8));
+    rom->bytes[1] = (uint8_t)main;
+
+    emit(rom, 0x6E00);
+    const uint8_t A = 0xA, B = 0xB, F = 0xF;
+    emit_alu_case(rom, 0x4, A, B, 0xFF, 0x01, 0x00, 1);
+    emit_alu_case(rom, 0x4, A, B, 0x10, 0x20, 0x30, 0);
+    emit_alu_case(rom, 0x4, A, B, 0x80, 0x80, 0x00, 1);
+    emit_alu_case(rom, 0x5, A, B, 0x05, 0x03, 0x02, 1);
+    emit_alu_case(rom, 0x5, A, B, 0x03, 0x05, 0xFE, 0);
+    emit_alu_case(rom, 0x5, A, B, 0x07, 0x07, 0x00, 1);
+    emit_alu_case(rom, 0x6, A, B, 0x05, 0x00, 0x02, 1);
+    emit_alu_case(rom, 0x6, A, B, 0x04, 0x00, 0x02, 0);
+    emit_alu_case(rom, 0x7, A, B, 0x03, 0x05, 0x02, 1);
+    emit_alu_case(rom, 0x7, A, B, 0x05, 0x03, 0xFE, 0);
+    emit_alu_case(rom, 0x7, A, B, 0x07, 0x07, 0x00, 1);
+    emit_alu_case(rom, 0xE, A, B, 0x81, 0x00, 0x02, 1);
+    emit_alu_case(rom, 0xE, A, B, 0x41, 0x00, 0x82, 0);
+    // VF as the destination ends up holding the flag, as the source it is
+    // read before being overwritten
+    emit_alu_case(rom, 0x4, F, B, 0xFF, 0x01, 0, 1);
+    emit_alu_case(rom, 0x5, F, B, 0x03, 0x05, 0, 0);
+    emit_alu_case(rom, 0x6, F, B, 0x04, 0x00, 0, 0);
+    emit_alu_case(rom, 0x7, F, B, 0x05, 0x03, 0, 0);
+    emit_alu_case(rom, 0xE, F, B, 0x81, 0x00, 0, 1);
+    emit_alu_case(rom, 0x4, A, F, 0x10, 0x20, 0x30, 0);
+
+    // A taken skip steps over the 7E01, one not taken lets 6D01 run
+    static const uint16_t skips[] = {
+        0x6A05, 0x6B05, 0x6C06,
+        0x3A05, 0x7E01,                         // 3XNN taken
+        0x6D00, 0x3A06, 0x6D01, 0x3D01, 0x7E01, // 3XNN not taken
+        0x4A06, 0x7E01,                         // 4XNN taken
+        0x6D00, 0x4A05, 0x6D01, 0x3D01, 0x7E01, // 4XNN not taken
+        0x5AB0, 0x7E01,                         // 5XY0 taken
+        0x6D00, 0x5AC0, 0x6D01, 0x3D01, 0x7E01, // 5XY0 not taken
+        0x9AC0, 0x7E01,                         // 9XY0 taken
+        0x6D00, 0x9AB0, 0x6D01, 0x3D01, 0x7E01, // 9XY0 not taken
+        0xEAA1, 0x7E01,                         // EXA1 taken, no key is down
+        0x6D00, 0xEA9E, 0x6D01, 0x3D01, 0x7E01, // EX9E not taken
+    };
+    for(size_t i = 0; i < sizeof(skips) / sizeof(skips[0]); i++) emit(rom, skips[i]);
+
+    // Two calls in a row must both come back, then the deep recursion
+    emit(rom, 0x6D00);
+    emit(rom, 0x2000 | once);
+    emit(rom, 0x2000 | once);
+    emit(rom, 0x3D02);
+    emit(rom, 0x7E01);
+    emit(rom, 0x6D00);
+    emit(rom, 0x2000 | deep);
+    emit(rom, (uint16_t)(0x3D00 | CHIP8_STACK_DEPTH / 2));
+    emit(rom, 0x7E01);
+
+    // FX33 and FX55/FX65 round trips through memory
+    static const uint16_t memory[] = {
+        0x6A9C, 0xA300, 0xFA33, 0xF265,
+        0x3001, 0x7E01, 0x3105, 0x7E01, 0x3206, 0x7E01,
+        0x6012, 0x6134, 0xA310, 0xF155, 0x6000, 0x6100, 0xF165,
+        0x3012, 0x7E01, 0x3134, 0x7E01,
+    };
+    for(size_t i = 0; i < sizeof(memory) / sizeof(memory[0]); i++) emit(rom, memory[i]);
+
+    static const uint16_t report[] = {
+        0xA300, 0xFE33, 0xF265, 0x6318, 0x640D,
+        0xF029, 0xD345, 0x7305, 0xF129, 0xD345, 0x7305, 0xF229, 0xD345,
+    };
+    for(size_t i = 0; i < sizeof(report) / sizeof(report[0]); i++) emit(rom, report[i]);
+    emit(rom, 0x1000 | here(rom));
+}
+
+// Polls the delay timer for 30 frames, flips a sprite and starts over. At
+// CONFORM_INSTRUCTIONS_PER_FRAME, which is not a multiple of three, frames
+// start on every instruction of the three instruction poll loop in turn.
+#define CONFORM_IDLE_LOOP (CHIP8_ROM_B + 4)
+static void build_idle(Rom* rom)
+{
+    emit(rom, 0x601E);
+    emit(rom, 0xF015);
+    emit(rom, 0xF207);
+    emit(rom, 0x3200);
+    emit(rom, 0x1000 | CONFORM_IDLE_LOOP);
+    emit(rom, 0x6300);
+    emit(rom, 0xA000);
+    emit(rom, 0xD335);
+    emit(rom, 0x1000 | CHIP8_ROM_B);
+}
+
+static bool idle_must_skip(const Chip8* c)
+{
+    return c->delay_timer != 0 && c->PC >= CONFORM_IDLE_LOOP && c->PC <= CONFORM_IDLE_LOOP + 4;
+}
+
+// Waits for a key with FX0A and draws its digit next to the last one,
+// forever. The script presses 5, then A while 5 is still held from before
+// the wait, which only A may end, then 5 again once released.
+static void build_keywait(Rom* rom)
+{
+    emit(rom, 0x6000);
+    emit(rom, 0x6100);
+    const uint16_t loop = here(rom);
+    emit(rom, 0xF30A);
+    emit(rom, 0xF329);
+    emit(rom, 0xD015);
+    emit(rom, 0x7005);
+    emit(rom, 0x1000 | loop);
+}
+
+static uint16_t keywait_keys(uint64_t frame)
+{
+    uint16_t keys = 0;
+    if(frame >= 5 && frame < 20) keys |= 1u << 0x5;
+    if(frame >= 12 && frame < 15) keys |= 1u << 0xA;
+    if(frame >= 30 && frame < 33) keys |= 1u << 0x5;
+    return keys;
+}
+
+static const Builtin builtins[] = {
+    { "selfcheck", build_selfcheck, NULL, NULL },
+    { "idle", build_idle, idle_must_skip, NULL },
+    { "keywait", build_keywait, NULL, keywait_keys },
+};
+
+// NULL when the entry is a ROM file or names no builtin
+static const Builtin* find_builtin(const Entry* e)
+{
+    const size_t prefix = strlen(CONFORM_BUILTIN_PREFIX);
+    if(strncmp(e->name, CONFORM_BUILTIN_PREFIX, prefix) != 0) {
+        return NULL;
+    }
+    for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if(strcmp(e->name + prefix, builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+static bool load_entry_rom(Chip8* c, const Entry* e)
+{
+    const Builtin* builtin = find_builtin(e);
+    if(builtin != NULL) {
+        Rom rom = {0};
+        builtin->build(&rom);
+        return chip8_load_rom(c, rom.bytes, rom.size);
+    }
+    if(strncmp(e->name, CONFORM_BUILTIN_PREFIX, strlen(CONFORM_BUILTIN_PREFIX)) != 0) {
+        return chip8_load_rom_file(c, e->path);
+    }
+    chip8_log(c, CHIP8_LOG_ERROR, "There is no %s\n", e->name);
+    return false;
+}
+
+// A frame like chip8_run_frame, through one engine and without a host
+typedef uint64_t (*Engine_Run)(Chip8* c, uint64_t count);
+
+typedef struct {
+    const char* name;
+    Engine_Run run; // NULL for the SoA engine
+    bool frame; // run is chip8_run_frame, which ticks the timers itself
+    Chip8* c;
+    Chip8_Soa* soa;
+} Engine;
+
+static void conform_log(void* user, Chip8_Log_Level level, const char* message)
+{
+    Entry* e = user;
+    if(level >= CHIP8_LOG_WARNING && e->reason[0] == '\0') {
+        snprintf(e->reason, sizeof(e->reason), "%.*s", (int)strcspn(message, "\n"), message);
+    }
+}
+
+static bool init_instance(Chip8* c, Entry* e)
+{
+    const Chip8_Host host = {
+        .user = e,
+        .log = conform_log,
+    };
+    return chip8_init(c, &host) && load_entry_rom(c, e);
+}
+
+static void fail(Entry* e, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(e->reason, sizeof(e->reason), fmt, args);
+    va_end(args);
+    e->status = ENTRY_FAILED;
+    if(!keep_going) atomic_store(&stop, true);
+}
+
+static void run_entry(Entry* e, Chip8* instances)
+{
+    Chip8* reference = &instances[0];
+    const Builtin* builtin = find_builtin(e);
+    Engine engines[5];
+    size_t engine_count = 0;
+    bool ok = init_instance(reference, e);
+
+#ifdef CHIP8_THREADED_DISPATCH
+    if(ok && !update) {
+        engines[engine_count] = (Engine){ .name = "threaded", .run = chip8_run_threaded,
+            .c = &instances[1 + engine_count] };
+        ok = init_instance(engines[engine_count++].c, e);
+    }
+#endif
+#ifdef CHIP8_JIT
+    if(ok && !update) {
+        engines[engine_count] = (Engine){ .name = "jit", .run = chip8_run_jit,
+            .c = &instances[1 + engine_count] };
+        ok = init_instance(engines[engine_count].c, e);
+        // Without a JIT on this host chip8_run_jit would just interpret
+        if(ok && chip8_jit_init(engines[engine_count].c)) engine_count++;
+        else chip8_deinit(engines[engine_count].c); // also when init_instance failed
+    }
+#endif
+    if(ok && !update) {
+        engines[engine_count] = (Engine){ .name = "frame", .run = chip8_run_frame, .frame = true,
+            .c = &instances[1 + engine_count] };
+        ok = init_instance(engines[engine_count++].c, e);
+#ifdef CHIP8_PROFILE
+        // chip8_run_frame runs every instruction while profiling
+        if(ok) {
+            chip8_profile_destroy(engines[engine_count - 1].c->profile);
+            engines[engine_count - 1].c->profile = NULL;
+        }
+#endif
+    }
+    if(ok && !update) {
+        engines[engine_count] = (Engine){ .name = "soa", .c = &instances[1 + engine_count] };
+        engines[engine_count].soa = chip8_soa_create(reference, CONFORM_SOA_LANES);
+        ok = engines[engine_count].soa != NULL;
+        if(ok) engine_count++;
+        else chip8_log(reference, CHIP8_LOG_ERROR, "Out of memory for the SoA engine\n");
+    }
+    if(!ok) {
+        // The log callback left the reason
+        fail(e, "%s", e->reason);
+    }
+
+    uint64_t quiet_frames = 0;
+    uint64_t display = chip8_display_hash(reference);
+    for(e->frames = 0; ok && e->frames < e->max_frames && quiet_frames < CONFORM_QUIET_FRAMES; e->frames++) {
+        // Somebody else failed, this one counts as skipped
+        if(atomic_load(&stop)) {
+            ok = false;
+            break;
+        }
+        bool keypad[16] = {0};
+        if(builtin != NULL && builtin->keys != NULL) {
+            const uint16_t keys = builtin->keys(e->frames);
+            for(int k = 0; k < 16; k++) keypad[k] = (keys >> k) & 1;
+        }
+        memcpy(reference->keypad, keypad, sizeof(keypad));
+        chip8_wait_key(reference);
+        chip8_run_switch(reference, CONFORM_INSTRUCTIONS_PER_FRAME);
+        chip8_update_timers(reference);
+        const uint64_t state = chip8_replay_hash(reference);
+
+        for(size_t i = 0; ok && i < engine_count; i++) {
+            Engine* engine = &engines[i];
+            if(engine->soa == NULL) {
+                memcpy(engine->c->keypad, keypad, sizeof(keypad));
+                const uint64_t skipped = engine->c->skipped;
+                const bool must_skip = engine->frame && builtin != NULL && builtin->must_skip != NULL
+                    && builtin->must_skip(engine->c);
+                // chip8_run_frame wakes FX0A itself
+                if(!engine->frame) chip8_wait_key(engine->c);
+                engine->run(engine->c, CONFORM_INSTRUCTIONS_PER_FRAME);
+                if(engine->frame) {
+                    // The reference does not count cycles
+                    engine->c->cycles = reference->cycles;
+                } else {
+                    chip8_update_timers(engine->c);
+                }
+                if(must_skip && engine->c->skipped == skipped) {
+                    fail(e, "%s did not skip the idle loop in frame %llu, PC %04X",
+                            engine->name, (unsigned long long)e->frames, engine->c->PC);
+                    ok = false;
+                } else if(chip8_replay_hash(engine->c) != state) {
+                    fail(e, "%s diverged from the reference in frame %llu, PC %04X instead of %04X",
+                            engine->name, (unsigned long long)e->frames, engine->c->PC, reference->PC);
+                    ok = false;
+                }
+                continue;
+            }
+            for(uint32_t lane = 0; lane < CONFORM_SOA_LANES; lane++) {
+                chip8_soa_input(engine->soa, lane, keypad);
+            }
+            chip8_step_batch(engine->soa, CONFORM_INSTRUCTIONS_PER_FRAME);
+            chip8_soa_update_timers(engine->soa);
+            for(uint32_t lane = 0; ok && lane < CONFORM_SOA_LANES; lane++) {
+                chip8_soa_read(engine->soa, lane, engine->c);
+                if(chip8_replay_hash(engine->c) != state) {
+                    fail(e, "soa lane %u diverged from the reference in frame %llu, PC %04X instead of %04X",
+                            lane, (unsigned long long)e->frames, engine->c->PC, reference->PC);
+                    ok = false;
+                }
+            }
+        }
+
+        const uint64_t next = chip8_display_hash(reference);
+        quiet_frames = next == display ? quiet_frames + 1 : 0;
+        display = next;
+    }
+
+    if(ok) {
+        e->hash = display;
+        e->quiet = quiet_frames >= CONFORM_QUIET_FRAMES;
+        if(update || (e->has_golden && e->hash == e->golden)) {
+            e->status = ENTRY_PASSED;
+        } else if(!e->has_golden) {
+            fail(e, "no golden yet, display %016llx after %llu frames, see --update",
+                    (unsigned long long)e->hash, (unsigned long long)e->frames);
+        } else {
+            fail(e, "display %016llx after %llu frames, expected %016llx",
+                    (unsigned long long)e->hash, (unsigned long long)e->frames,
+                    (unsigned long long)e->golden);
+        }
+    }
+
+    for(size_t i = 0; i < engine_count; i++) {
+        if(engines[i].soa != NULL) chip8_soa_destroy(engines[i].soa);
+        else chip8_deinit(engines[i].c);
+    }
+    chip8_deinit(reference);
+}
+
+static int worker(void* arg)
+{
+    (void)arg;
+    // The reference, one instance per engine and a scratch one for SoA lanes
+    Chip8* instances = malloc(6 * sizeof(*instances));
+    if(instances == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        atomic_store(&stop, true);
+        return 1;
+    }
+    while(!atomic_load(&stop)) {
+        const size_t i = atomic_fetch_add(&next_entry, 1);
+        if(i >= entry_count) {
+            break;
+        }
+        run_entry(&entries[i], instances);
+    }
+    free(instances);
+    return 0;
+}
+
+static bool read_goldens(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        fprintf(stderr, "Goldens file %s is invalid or not exist\n", path);
+        return false;
+    }
+
+    // ROM paths are relative to the directory holding the goldens
+    char dir[1024] = "";
+    const char* slash = strrchr(path, '/');
+#ifdef _WIN32
+    const char* backslash = strrchr(path, '\\');
+    if(backslash > slash) slash = backslash;
+#endif
+    if(slash != NULL) {
+        snprintf(dir, sizeof(dir), "%.*s/", (int)(slash - path), path);
+    }
+
+    char line[1024];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line_count == line_capacity) lines = grow(lines, &line_capacity, sizeof(*lines));
+        lines[line_count] = malloc(strlen(line) + 1);
+        if(lines[line_count] == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(69);
+        }
+        strcpy(lines[line_count++], line);
+        if(line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        char hash[32];
+        unsigned long long frames;
+        int name_at = 0;
+        if(sscanf(line, "%31s %llu %n", hash, &frames, &name_at) != 2 || line[name_at] == '\0') {
+            fprintf(stderr, "%s:%zu: expected <hash> <max frames> <rom>\n", path, line_count);
+            fclose(f);
+            return false;
+        }
+        if(entry_count == entry_capacity) entries = grow(entries, &entry_capacity, sizeof(*entries));
+        Entry* e = &entries[entry_count++];
+        memset(e, 0, sizeof(*e));
+        e->line = line_count - 1;
+        e->max_frames = frames;
+        e->has_golden = strcmp(hash, "-") != 0;
+        e->golden = strtoull(hash, NULL, 16);
+        e->path = malloc(strlen(dir) + strlen(line + name_at) + 1);
+        if(e->path == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(69);
+        }
+        sprintf(e->path, "%s%s", dir, line + name_at);
+        e->name = e->path + strlen(dir);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool write_goldens(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if(f == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", path);
+        return false;
+    }
+    size_t entry = 0;
+    bool ok = true;
+    for(size_t i = 0; ok && i < line_count; i++) {
+        if(entry < entry_count && entries[entry].line == i) {
+            const Entry* e = &entries[entry++];
+            if(e->status == ENTRY_PASSED) {
+                ok = fprintf(f, "%016llx %llu %s\n", (unsigned long long)e->hash,
+                        (unsigned long long)e->max_frames, e->name) > 0;
+                continue;
+            }
+        }
+        ok = fprintf(f, "%s\n", lines[i]) > 0;
+    }
+    ok = fclose(f) == 0 && ok;
+    if(!ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+    }
+    return ok;
+}
+
+int main(int argc, const char** argv)
+{
+    const char* goldens = NULL;
+    uint32_t worker_count = core_count();
+
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            worker_count = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--keep-going") == 0) {
+            keep_going = true;
+        } else if(strcmp(argv[i], "--update") == 0) {
+            update = true;
+        } else if(goldens == NULL && argv[i][0] != '-') {
+            goldens = argv[i];
+        } else {
+            goldens = NULL;
+            break;
+        }
+    }
+    if(goldens == NULL) {
+        fprintf(stderr, "USAGE: %s [-j <threads>] [--keep-going] [--update] <goldens>\n", argv[0]);
+        return 69;
+    }
+    if(!read_goldens(goldens)) {
+        return 69;
+    }
+    if(entry_count == 0) {
+        fprintf(stderr, "No ROMs listed in %s\n", goldens);
+        return 69;
+    }
+    // Updating has to get through every ROM
+    if(update) keep_going = true;
+
+    if(worker_count < 1) worker_count = 1;
+    if(worker_count > CONFORM_MAX_WORKERS) worker_count = CONFORM_MAX_WORKERS;
+    if(worker_count > entry_count) worker_count = (uint32_t)entry_count;
+
+    thrd_t threads[CONFORM_MAX_WORKERS];
+    uint32_t started = 0;
+    for(; started < worker_count; started++) {
+        if(thrd_create(&threads[started], worker, NULL) != thrd_success) {
+            fprintf(stderr, "Failed to start worker %u, continuing with %u\n", started, started);
+            break;
+        }
+    }
+    if(started == 0) {
+        worker(NULL);
+    }
+    for(uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+
+    uint32_t passed = 0, failed = 0, skipped = 0;
+    for(size_t i = 0; i < entry_count; i++) {
+        const Entry* e = &entries[i];
+        switch(e->status) {
+            case ENTRY_PASSED:
+                {
+                    printf("ok      %016llx %6llu%s  %s\n", (unsigned long long)e->hash,
+                            (unsigned long long)e->frames, e->quiet ? " " : "+", e->name);
+                    passed++;
+                } break;
+            case ENTRY_FAILED:
+                {
+                    printf("FAILED  %s: %s\n", e->name, e->reason);
+                    failed++;
+                } break;
+            case ENTRY_PENDING:
+                {
+                    printf("skipped %s\n", e->name);
+                    skipped++;
+                } break;
+        }
+    }
+    printf("%u passed, %u failed, %u skipped (+ never went quiet)\n", passed, failed, skipped);
+
+    bool ok = failed == 0 && skipped == 0;
+    if(update && !write_goldens(goldens)) {
+        ok = false;
+    }
+
+    for(size_t i = 0; i < entry_count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+    for(size_t i = 0; i < line_count; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,579 @@
+// chip8-fuzz: differential fuzzing of the execution engines.
+//
+//     chip8-fuzz [options]             generate and run random inputs
+//     chip8-fuzz <input>...            run saved inputs and explain them
+//
+//     --runs <n>      inputs to generate (default: until a divergence)
+//     --seed <n>      seed of the generator (default 1)
+//     --blocks <n>    basic blocks per input (default 2000)
+//
+// An input is a ROM plus what the outside world does while it runs:
+//
+//     offset  size  field
+//          0     4  seed of the CXNN generator, little-endian
+//          4     1  event count n, at most FUZZ_MAX_EVENTS
+//          5   4*n  events: u16 block, u16 keypad, both little-endian
+//          *     *  ROM, at most 3584 bytes
+//
+// The reference executes one chip8_emulate_instruction at a time and ends a
+// basic block after every jump, call, return or skip, or after
+// FUZZ_MAX_BLOCK_LENGTH instructions. Every other engine in the build
+// (chip8_run_switch with its superinstructions, THREADED=1, JIT=1 and the
+// lockstep SoA engine) then runs the same number
+// of instructions and its save state, so RAM, V, I, PC, stack, timers and
+// display, must be identical to the reference's. Timers tick whenever a
+// frame's worth of instructions has gone by, events set the keypad before
+// their block and every block starts with chip8_wait_key, the way
+// chip8_step_batch starts. The AOT translator is not covered, it needs the ROM at build
+// time.
+//
+// On the first divergence the input is minimized, by dropping events and
+// replacing as much of the ROM as possible with zero bytes (0NNN, a nop),
+// and written to divergence-<hash>.c8f. Running chip8-fuzz on that file
+// prints the diverging block disassembled and the fields that differ.
+//
+// Built with -DCHIP8_FUZZ_LIBFUZZER the file provides LLVMFuzzerTestOneInput
+// instead of main and libFuzzer generates the inputs:
+//
+//     clang -g -O1 -fsanitize=fuzzer,address -DCHIP8_FUZZ_LIBFUZZER -DCHIP8_THREADED_DISPATCH
+//         -DCHIP8_JIT -Isrc tools/chip8_fuzz.c src/chip8*.c -lpthread
+#include "chip8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_HEADER_SIZE 5
+#define FUZZ_EVENT_SIZE 4
+#define FUZZ_MAX_EVENTS 32
+#define FUZZ_MAX_ROM (CHIP8_RAM_CAPACITY - CHIP8_ROM_B)
+#define FUZZ_MAX_INPUT (FUZZ_HEADER_SIZE + FUZZ_EVENT_SIZE*FUZZ_MAX_EVENTS + FUZZ_MAX_ROM)
+#define FUZZ_MAX_BLOCK_LENGTH 32
+#define FUZZ_DEFAULT_BLOCKS 2000
+#define FUZZ_INSTRUCTIONS_PER_FRAME (CHIP8_DEFAULT_CPU_HZ / CHIP8_FRAME_RATE)
+#define FUZZ_SOA_LANES 2
+#define FUZZ_MAX_ENGINES 4
+
+typedef struct {
+    uint32_t seed;
+    uint32_t event_count;
+    struct {
+        uint16_t block;
+        uint16_t keys;
+    } events[FUZZ_MAX_EVENTS];
+    const uint8_t* rom;
+    size_t rom_size;
+} Input;
+
+typedef struct {
+    const char* name;
+    uint64_t (*run)(Chip8* c, uint64_t count); // NULL for the SoA engine
+    Chip8* c;
+    Chip8_Soa* soa;
+} Engine;
+
+typedef struct {
+    bool found;
+    const char* engine;
+    uint64_t block;
+    uint16_t block_pc; // where the reference started the block
+    uint32_t block_length;
+    size_t offset; // first differing byte of the save states
+    uint8_t expected[CHIP8_STATE_MAX_SIZE], got[CHIP8_STATE_MAX_SIZE];
+    size_t size;
+} Divergence;
+
+static Chip8 instances[1 + FUZZ_MAX_ENGINES];
+static uint64_t max_blocks = FUZZ_DEFAULT_BLOCKS;
+
+static bool parse_input(const uint8_t* data, size_t size, Input* in)
+{
+    if(size < FUZZ_HEADER_SIZE) {
+        return false;
+    }
+    in->seed = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    in->event_count = data[4];
+    if(in->event_count > FUZZ_MAX_EVENTS
+            || size < FUZZ_HEADER_SIZE + FUZZ_EVENT_SIZE*in->event_count) {
+        return false;
+    }
+    const uint8_t* p = data + FUZZ_HEADER_SIZE;
+    for(uint32_t i = 0; i < in->event_count; i++, p += FUZZ_EVENT_SIZE) {
+        in->events[i].block = (uint16_t)(p[0] | (p[1] << 8));
+        in->events[i].keys = (uint16_t)(p[2] | (p[3] << 8));
+    }
+    in->rom = p;
+    in->rom_size = size - (size_t)(p - data);
+    if(in->rom_size > FUZZ_MAX_ROM) in->rom_size = FUZZ_MAX_ROM;
+    return true;
+}
+
+static size_t write_input(const Input* in, uint8_t* out)
+{
+    for(int i = 0; i < 4; i++) out[i] = (uint8_t)(in->seed >> (8*i));
+    out[4] = (uint8_t)in->event_count;
+    uint8_t* p = out + FUZZ_HEADER_SIZE;
+    for(uint32_t i = 0; i < in->event_count; i++, p += FUZZ_EVENT_SIZE) {
+        p[0] = (uint8_t)in->events[i].block;
+        p[1] = (uint8_t)(in->events[i].block >> 8);
+        p[2] = (uint8_t)in->events[i].keys;
+        p[3] = (uint8_t)(in->events[i].keys >> 8);
+    }
+    memmove(p, in->rom, in->rom_size);
+    return (size_t)(p - out) + in->rom_size;
+}
+
+static void quiet_log(void* user, Chip8_Log_Level level, const char* message)
+{
+    (void)user;
+    (void)level;
+    (void)message;
+}
+
+static bool start_instance(Chip8* c, const Input* in)
+{
+    const Chip8_Host host = {
+        .log = quiet_log,
+    };
+    if(!chip8_init(c, &host) || !chip8_load_rom(c, in->rom, in->rom_size)) {
+        return false;
+    }
+    chip8_seed(c, in->seed);
+    return true;
+}
+
+static size_t start_engines(const Input* in, Engine* engines)
+{
+    size_t count = 0;
+    engines[count] = (Engine){ .name = "switch", .run = chip8_run_switch, .c = &instances[1 + count] };
+    if(start_instance(engines[count].c, in)) count++;
+#ifdef CHIP8_THREADED_DISPATCH
+    engines[count] = (Engine){ .name = "threaded", .run = chip8_run_threaded, .c = &instances[1 + count] };
+    if(start_instance(engines[count].c, in)) count++;
+#endif
+#ifdef CHIP8_JIT
+    engines[count] = (Engine){ .name = "jit", .run = chip8_run_jit, .c = &instances[1 + count] };
+    if(start_instance(engines[count].c, in)) {
+        // Without a JIT on this host chip8_run_jit would just interpret
+        if(chip8_jit_init(engines[count].c)) count++;
+        else chip8_deinit(engines[count].c);
+    }
+#endif
+    // The SoA lanes start as copies of the reference, its Chip8 is only
+    // scratch space to read a lane into
+    engines[count] = (Engine){ .name = "soa", .c = &instances[1 + count] };
+    engines[count].soa = chip8_soa_create(&instances[0], FUZZ_SOA_LANES);
+    if(engines[count].soa != NULL) count++;
+    return count;
+}
+
+static void stop_engines(Engine* engines, size_t count)
+{
+    for(size_t i = 0; i < count; i++) {
+        if(engines[i].soa != NULL) chip8_soa_destroy(engines[i].soa);
+        else chip8_deinit(engines[i].c);
+    }
+    chip8_deinit(&instances[0]);
+}
+
+static bool is_block_end(uint16_t opcode)
+{
+    switch(opcode >> 12) {
+        case 0x0: return opcode == 0x00EE;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x9:
+        case 0xB: return true;
+        case 0xE: return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+        default: return false;
+    }
+}
+
+static void set_keypad(Chip8* c, uint16_t keys)
+{
+    for(int k = 0; k < 16; k++) {
+        c->keypad[k] = (keys >> k) & 1;
+    }
+}
+
+// Runs one input on every engine, stops at the first divergence
+static void run_input(const Input* in, Divergence* d)
+{
+    d->found = false;
+    Chip8* reference = &instances[0];
+    if(!start_instance(reference, in)) {
+        chip8_deinit(reference);
+        return;
+    }
+    Engine engines[FUZZ_MAX_ENGINES];
+    const size_t engine_count = start_engines(in, engines);
+
+    uint64_t instructions = 0, next_frame = FUZZ_INSTRUCTIONS_PER_FRAME;
+    for(uint64_t block = 0; block < max_blocks && !d->found; block++) {
+        for(uint32_t e = 0; e < in->event_count; e++) {
+            if(in->events[e].block != block) continue;
+            set_keypad(reference, in->events[e].keys);
+            for(size_t i = 0; i < engine_count; i++) {
+                if(engines[i].soa == NULL) {
+                    set_keypad(engines[i].c, in->events[e].keys);
+                    continue;
+                }
+                for(uint32_t lane = 0; lane < FUZZ_SOA_LANES; lane++) {
+                    chip8_soa_read(engines[i].soa, lane, engines[i].c);
+                    set_keypad(engines[i].c, in->events[e].keys);
+                    chip8_soa_write(engines[i].soa, lane, engines[i].c);
+                }
+            }
+        }
+
+        chip8_wait_key(reference);
+        const uint16_t block_pc = reference->PC;
+        uint32_t length = 0;
+        bool end = false;
+        while(!end && length < FUZZ_MAX_BLOCK_LENGTH) {
+            const uint16_t opcode = (uint16_t)((reference->ram[reference->PC & CHIP8_ADDRESS_MASK] << 8)
+                    | reference->ram[(reference->PC + 1) & CHIP8_ADDRESS_MASK]);
+            chip8_emulate_instruction(reference);
+            end = is_block_end(opcode);
+            length++;
+        }
+        instructions += length;
+        const bool tick = instructions >= next_frame;
+        if(tick) {
+            chip8_update_timers(reference);
+            next_frame += FUZZ_INSTRUCTIONS_PER_FRAME;
+        }
+        d->size = chip8_save_state(reference, d->expected, sizeof(d->expected));
+
+        for(size_t i = 0; i < engine_count && !d->found; i++) {
+            Engine* engine = &engines[i];
+            if(engine->soa == NULL) {
+                chip8_wait_key(engine->c);
+                engine->run(engine->c, length);
+                if(tick) chip8_update_timers(engine->c);
+            } else {
+                chip8_step_batch(engine->soa, length);
+                if(tick) chip8_soa_update_timers(engine->soa);
+            }
+            const uint32_t lanes = engine->soa != NULL ? FUZZ_SOA_LANES : 1;
+            for(uint32_t lane = 0; lane < lanes && !d->found; lane++) {
+                if(engine->soa != NULL) chip8_soa_read(engine->soa, lane, engine->c);
+                const size_t size = chip8_save_state(engine->c, d->got, sizeof(d->got));
+                if(size == d->size && memcmp(d->got, d->expected, size) == 0) continue;
+                d->found = true;
+                d->engine = engine->name;
+                d->block = block;
+                d->block_pc = block_pc;
+                d->block_length = length;
+                d->offset = 0;
+                while(d->offset < size && d->offset < d->size && d->got[d->offset] == d->expected[d->offset]) {
+                    d->offset++;
+                }
+            }
+        }
+    }
+    stop_engines(engines, engine_count);
+}
+
+// Shrinks a diverging input in place, keeps only changes that still diverge
+static void minimize(Input* in, uint8_t* rom)
+{
+    Divergence* d = malloc(sizeof(*d));
+    if(d == NULL) {
+        return;
+    }
+    memcpy(rom, in->rom, in->rom_size);
+    in->rom = rom;
+    run_input(in, d);
+    if(!d->found) {
+        free(d);
+        return;
+    }
+    max_blocks = d->block + 1;
+
+    for(uint32_t e = in->event_count; e-- > 0;) {
+        Input smaller = *in;
+        memmove(&smaller.events[e], &smaller.events[e+1], (smaller.event_count - e - 1) * sizeof(smaller.events[0]));
+        smaller.event_count--;
+        run_input(&smaller, d);
+        if(d->found) *in = smaller;
+    }
+
+    // Zeroing instead of cutting keeps every address where it was
+    uint8_t saved[FUZZ_MAX_ROM];
+    for(size_t chunk = in->rom_size; chunk > 0; chunk /= 2) {
+        for(size_t at = 0; at < in->rom_size; at += chunk) {
+            const size_t n = at + chunk > in->rom_size ? in->rom_size - at : chunk;
+            bool zero = true;
+            for(size_t k = 0; k < n; k++) zero = zero && rom[at + k] == 0;
+            if(zero) continue;
+            memcpy(saved, rom + at, n);
+            memset(rom + at, 0, n);
+            run_input(in, d);
+            if(!d->found) memcpy(rom + at, saved, n);
+        }
+    }
+    while(in->rom_size > 0 && rom[in->rom_size - 1] == 0) in->rom_size--;
+
+    // Ends at the block that diverges
+    run_input(in, d);
+    if(d->found) max_blocks = d->block + 1;
+    free(d);
+}
+
+static const char* state_field(size_t offset)
+{
+    if(offset < 8) return "header";
+    if(offset < 24) return "V";
+    if(offset < 26) return "I";
+    if(offset < 28) return "PC";
+    if(offset < 30) return "stack pointer";
+    if(offset < 32) return "timers";
+    if(offset < 34) return "keypad";
+    if(offset < 38) return "CXNN generator";
+    if(offset < 46) return "cycles";
+    if(offset < CHIP8_STATE_HEADER_SIZE) return "FX0A wait";
+    if(offset < CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY) return "RAM";
+    return "display";
+}
+
+static void report(const Input* in, const Divergence* d)
+{
+    printf("%s diverged from the reference in block %llu, %u instructions from PC %03X\n",
+            d->engine, (unsigned long long)d->block, d->block_length, d->block_pc);
+
+    // The ROM is reloaded to disassemble the block as it was at the start
+    Chip8* c = &instances[0];
+    if(start_instance(c, in)) {
+        uint16_t pc = d->block_pc;
+        uint32_t repeats = 0;
+        for(uint32_t i = 0; i < d->block_length; i++, pc += 2) {
+            const uint16_t opcode = (uint16_t)((c->ram[pc & CHIP8_ADDRESS_MASK] << 8)
+                    | c->ram[(pc + 1) & CHIP8_ADDRESS_MASK]);
+            const uint16_t previous = (uint16_t)((c->ram[(pc - 2) & CHIP8_ADDRESS_MASK] << 8)
+                    | c->ram[(pc - 1) & CHIP8_ADDRESS_MASK]);
+            if(i > 0 && opcode == previous && i + 1 < d->block_length) {
+                repeats++;
+                continue;
+            }
+            if(repeats > 0) printf("    ...   %u more\n", repeats);
+            repeats = 0;
+            char text[32];
+            chip8_disassemble(opcode, text, sizeof(text));
+            printf("    %03X  %04X  %s\n", pc & CHIP8_ADDRESS_MASK, opcode, text);
+            if(is_block_end(opcode)) break;
+        }
+        chip8_deinit(c);
+    }
+
+    size_t shown = 0;
+    for(size_t i = d->offset; i < d->size && shown < 16; i++) {
+        if(d->got[i] == d->expected[i]) continue;
+        if(i < CHIP8_STATE_HEADER_SIZE) {
+            printf("    %-14s byte %2zu: %02X, expected %02X\n", state_field(i), i, d->got[i], d->expected[i]);
+        } else {
+            printf("    %-14s %04zX: %02X, expected %02X\n", state_field(i),
+                    i - (i < CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY
+                        ? CHIP8_STATE_HEADER_SIZE : CHIP8_STATE_HEADER_SIZE + CHIP8_RAM_CAPACITY),
+                    d->got[i], d->expected[i]);
+        }
+        shown++;
+    }
+}
+
+// Minimizes a diverging input and writes the reproducer, returns false if
+// it could not be written
+static bool save_divergence(const uint8_t* data, size_t size)
+{
+    Input in;
+    static uint8_t rom[FUZZ_MAX_ROM];
+    static uint8_t out[FUZZ_MAX_INPUT];
+    if(!parse_input(data, size, &in)) {
+        return false;
+    }
+    minimize(&in, rom);
+    const size_t out_size = write_input(&in, out);
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < out_size; i++) hash = (hash ^ out[i]) * 0x100000001b3ull;
+    char path[64];
+    snprintf(path, sizeof(path), "divergence-%08x.c8f", (uint32_t)hash);
+    FILE* f = fopen(path, "wb");
+    if(f == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", path);
+        return false;
+    }
+    const bool ok = fwrite(out, 1, out_size, f) == out_size;
+    if(fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return false;
+    }
+
+    static Divergence d;
+    run_input(&in, &d);
+    printf("Minimized to %zu ROM bytes, %u events, %llu blocks: %s\n", in.rom_size, in.event_count,
+            (unsigned long long)max_blocks, path);
+    if(d.found) report(&in, &d);
+    return true;
+}
+
+#ifdef CHIP8_FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static Divergence d;
+    Input in;
+    if(!parse_input(data, size, &in)) {
+        return 0;
+    }
+    run_input(&in, &d);
+    if(d.found) {
+        report(&in, &d);
+        save_divergence(data, size);
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+static uint32_t next_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Opcodes are mostly well formed and jumps land inside the ROM, uniformly
+// random bytes would spend most blocks running off into empty RAM
+static size_t generate_input(uint32_t* rng, uint8_t* out)
+{
+    static const uint16_t families[] = {
+        0x00E0, 0x00EE, 0x00FE, 0x00FF, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000,
+        0x7000, 0x8000, 0x8001, 0x8002, 0x8003, 0x8004, 0x8005, 0x8006, 0x8007, 0x800E,
+        0x9000, 0xA000, 0xB000, 0xC000, 0xD000, 0xE09E, 0xE0A1, 0xF007, 0xF00A, 0xF015,
+        0xF018, 0xF01E, 0xF029, 0xF033, 0xF055, 0xF065,
+    };
+    Input in = {0};
+    in.seed = next_random(rng);
+    in.event_count = next_random(rng) % 9;
+    for(uint32_t i = 0; i < in.event_count; i++) {
+        in.events[i].block = (uint16_t)(next_random(rng) % max_blocks);
+        in.events[i].keys = (uint16_t)(1u << (next_random(rng) % 16));
+    }
+
+    static uint8_t rom[FUZZ_MAX_ROM];
+    in.rom_size = 2 + 2 * (next_random(rng) % 256);
+    for(size_t i = 0; i < in.rom_size; i += 2) {
+        uint16_t opcode = (uint16_t)next_random(rng);
+        if(next_random(rng) % 8 != 0) {
+            const uint16_t family = families[next_random(rng) % (sizeof(families) / sizeof(families[0]))];
+            const uint16_t target = (uint16_t)(CHIP8_ROM_B + (next_random(rng) % in.rom_size & ~1u));
+            switch(family >> 12) {
+                case 0x0: opcode = family; break;
+                case 0x1:
+                case 0x2:
+                case 0xA:
+                case 0xB: opcode = (uint16_t)(family | target); break;
+                case 0x5:
+                case 0x8:
+                case 0x9: opcode = (uint16_t)(family | (opcode & 0x0FF0)); break;
+                case 0xE:
+                case 0xF: opcode = (uint16_t)(family | (opcode & 0x0F00)); break;
+                default: opcode = (uint16_t)(family | (opcode & 0x0FFF)); break;
+            }
+        }
+        rom[i] = (uint8_t)(opcode >> 8);
+        rom[i+1] = (uint8_t)opcode;
+    }
+    in.rom = rom;
+    return write_input(&in, out);
+}
+
+static bool run_file(const char* path)
+{
+    static uint8_t data[FUZZ_MAX_INPUT];
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Input %s is invalid or not exist\n", path);
+        return false;
+    }
+    const size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    Input in;
+    static Divergence d;
+    if(!parse_input(data, size, &in)) {
+        fprintf(stderr, "%s is not a chip8-fuzz input\n", path);
+        return false;
+    }
+    run_input(&in, &d);
+    if(d.found) {
+        printf("%s: ", path);
+        report(&in, &d);
+        return false;
+    }
+    printf("%s: no divergence in %llu blocks\n", path, (unsigned long long)max_blocks);
+    return true;
+}
+
+int main(int argc, const char** argv)
+{
+    uint64_t runs = UINT64_MAX;
+    uint32_t seed = 1;
+    const char* files[64];
+    int file_count = 0;
+
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--blocks") == 0 && i + 1 < argc) {
+            max_blocks = strtoull(argv[++i], NULL, 10);
+        } else if(argv[i][0] != '-' && file_count < (int)(sizeof(files) / sizeof(files[0]))) {
+            files[file_count++] = argv[i];
+        } else {
+            fprintf(stderr, "USAGE: %s [--runs <n>] [--seed <n>] [--blocks <n>] [input...]\n", argv[0]);
+            return 69;
+        }
+    }
+    if(max_blocks == 0) max_blocks = 1;
+
+    if(file_count > 0) {
+        bool ok = true;
+        for(int i = 0; i < file_count; i++) {
+            ok = run_file(files[i]) && ok;
+        }
+        return ok ? 0 : 1;
+    }
+
+    uint32_t rng = seed != 0 ? seed : 1;
+    static uint8_t data[FUZZ_MAX_INPUT];
+    static Divergence d;
+    for(uint64_t run = 0; run < runs; run++) {
+        const size_t size = generate_input(&rng, data);
+        Input in;
+        parse_input(data, size, &in);
+        run_input(&in, &d);
+        if(d.found) {
+            printf("Run %llu: ", (unsigned long long)run);
+            report(&in, &d);
+            save_divergence(data, size);
+            return 1;
+        }
+        if((run + 1) % 1000 == 0) {
+            fprintf(stderr, "%llu inputs, no divergence\n", (unsigned long long)(run + 1));
+        }
+    }
+    printf("%llu inputs of %llu blocks, no divergence\n", (unsigned long long)runs,
+            (unsigned long long)max_blocks);
+    return 0;
+}
+
+#endif // CHIP8_FUZZ_LIBFUZZER
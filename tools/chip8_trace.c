@@ -0,0 +1,94 @@
+// chip8-trace: decode and disassemble an instruction trace.
+//
+//     chip8-trace [--last <n>] <trace>
+//
+// A trace is written by a debug build of the emulator, see --trace and
+// src/chip8_trace.c for the format. Every record becomes one line with its
+// sequence number, the address, the opcode and its mnemonic, I as the
+// instruction saw it, and the registers it changed.
+#include "chip8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_HEADER_SIZE 24
+#define TRACE_RECORD_SIZE 8
+
+static uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint64_t get64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for(int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8*i);
+    return v;
+}
+
+int main(int argc, const char** argv)
+{
+    const char* path = NULL;
+    uint64_t last = UINT64_MAX;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+            last = strtoull(argv[++i], NULL, 10);
+        } else {
+            path = argv[i];
+        }
+    }
+    if(path == NULL) {
+        fprintf(stderr, "USAGE: %s [--last <n>] <trace>\n", argv[0]);
+        return 69;
+    }
+
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Trace file %s is invalid or not exist\n", path);
+        return 69;
+    }
+    uint8_t header[TRACE_HEADER_SIZE];
+    if(fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, "C8TR", 4) != 0) {
+        fprintf(stderr, "%s is not a CHIP-8 trace\n", path);
+        fclose(f);
+        return 69;
+    }
+    if(get16(header + 4) != 1 || get16(header + 6) != TRACE_RECORD_SIZE) {
+        fprintf(stderr, "Trace version %u is not supported\n", get16(header + 4));
+        fclose(f);
+        return 69;
+    }
+    const uint64_t first = get64(header + 8);
+    const uint64_t count = get64(header + 16);
+    const uint64_t skip = count > last ? count - last : 0;
+    if(fseek(f, (long)(skip * TRACE_RECORD_SIZE), SEEK_CUR) != 0) {
+        fprintf(stderr, "Trace %s is truncated\n", path);
+        fclose(f);
+        return 69;
+    }
+
+    printf("%12s  %-5s  %-4s  %-18s  %-5s  %s\n", "seq", "PC", "op", "instruction", "I", "changed");
+    for(uint64_t i = skip; i < count; i++) {
+        uint8_t record[TRACE_RECORD_SIZE];
+        if(fread(record, 1, sizeof(record), f) != sizeof(record)) {
+            fprintf(stderr, "Trace %s is truncated after %llu records\n", path, (unsigned long long)i);
+            fclose(f);
+            return 1;
+        }
+        const uint16_t opcode = get16(record + 2);
+        const uint16_t changed = get16(record + 6);
+        char text[32];
+        chip8_disassemble(opcode, text, sizeof(text));
+
+        char registers[16*4 + 1] = "";
+        char* p = registers;
+        for(int x = 0; x < 16; x++) {
+            if(changed & (1u << x)) p += sprintf(p, " V%X", x);
+        }
+        printf("%12llu  0x%03X  %04X  %-18s  0x%03X %s\n", (unsigned long long)(first + i),
+                get16(record), opcode, text, get16(record + 4), registers);
+    }
+    fclose(f);
+    return 0;
+}